@@ -0,0 +1,274 @@
+#pragma once
+
+#ifndef ALLOC_HPP
+#define ALLOC_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace crash {
+
+// where the engines get their slot arrays from by default.
+//
+// freed arrays are kept (up to `cache_limit` bytes) and handed back out to
+// the next request of exactly the same size, so clear/rehash cycles, tables
+// that are rebuilt over and over, and shards that grow in step stop going
+// back to malloc. everything is at least cache line aligned, and arrays of
+// `huge_page_threshold` bytes or more are 2MB aligned and madvise'd so the
+// kernel can back them with transparent huge pages, which takes most of the
+// TLB misses out of random probes. those are mapped on their own, so freeing
+// one (past the cache, or through trim) always hands the memory back
+class slab_pool {
+public:
+  static constexpr size_t huge_page_size = 2 << 20;
+  static constexpr size_t huge_page_threshold = 8 << 20;
+  static constexpr size_t cache_limit = 256 << 20;
+
+  slab_pool() = default;
+  slab_pool(const slab_pool &) = delete;
+  slab_pool &operator=(const slab_pool &) = delete;
+  ~slab_pool() {
+    for (auto &b : cached) {
+      release(b.p, b.bytes);
+    }
+  }
+
+  void *allocate(size_t bytes) {
+    {
+      std::lock_guard l(lock);
+      for (size_t i = 0; i < cached.size(); i++) {
+        if (cached[i].bytes == bytes) {
+          void *p = cached[i].p;
+          cached_bytes -= bytes;
+          cached[i] = cached.back();
+          cached.pop_back();
+          return p;
+        }
+      }
+    }
+    if (bytes < huge_page_threshold)
+      return ::operator new(bytes, std::align_val_t(64));
+    return map_huge(round_up(bytes));
+  }
+
+  void deallocate(void *p, size_t bytes) {
+    {
+      std::lock_guard l(lock);
+      if (cached_bytes + bytes <= cache_limit) {
+        cached.push_back({p, bytes});
+        cached_bytes += bytes;
+        return;
+      }
+    }
+    release(p, bytes);
+  }
+
+  // hand every cached array back to the system
+  void trim() {
+    std::vector<block> drop;
+    {
+      std::lock_guard l(lock);
+      drop.swap(cached);
+      cached_bytes = 0;
+    }
+    for (auto &b : drop) {
+      release(b.p, b.bytes);
+    }
+  }
+
+  // never destroyed, so tables in statics can still free into it
+  static slab_pool &shared() {
+    static slab_pool *pool = new slab_pool();
+    return *pool;
+  }
+
+  // how big arrays are mapped, also used by numa_allocator (numa.hpp)
+  static size_t round_up(size_t bytes) {
+    return (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+  }
+
+#if defined(__linux__)
+  // a 2MB aligned mapping, cut out of one a huge page longer
+  static void *map_huge(size_t len) {
+    void *raw = mmap(nullptr, len + huge_page_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+      throw std::bad_alloc();
+    uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+    uintptr_t p = (start + huge_page_size - 1) & ~(huge_page_size - 1);
+    if (p != start)
+      munmap(raw, p - start);
+    munmap(reinterpret_cast<void *>(p + len), huge_page_size - (p - start));
+#if defined(MADV_HUGEPAGE)
+    madvise(reinterpret_cast<void *>(p), len, MADV_HUGEPAGE);
+#endif
+    return reinterpret_cast<void *>(p);
+  }
+  static void unmap_huge(void *p, size_t len) { munmap(p, len); }
+#else
+  static void *map_huge(size_t len) {
+    void *p = std::aligned_alloc(huge_page_size, len);
+    if (!p)
+      throw std::bad_alloc();
+    return p;
+  }
+  static void unmap_huge(void *p, size_t) { std::free(p); }
+#endif
+
+private:
+  struct block {
+    void *p;
+    size_t bytes;
+  };
+
+  static void release(void *p, size_t bytes) {
+    if (bytes < huge_page_threshold)
+      ::operator delete(p, std::align_val_t(64));
+    else
+      unmap_huge(p, round_up(bytes));
+  }
+
+  std::mutex lock;
+  std::vector<block> cached;
+  size_t cached_bytes = 0;
+};
+
+// the default allocator for every engine's slot arrays, backed by
+// slab_pool::shared(). elements are default-initialized rather than
+// value-initialized, so a fresh array of trivial keys or values isn't zeroed
+// (and every page of it faulted in) up front. slots are only read once their
+// state says they were written, and state arrays are filled explicitly.
+//
+// with trivially destructible keys and values nothing walks the slots on the
+// way out, so freeing a table is a handful of array frees no matter how big
+// it is. string_key payloads go with their string_arena the same way
+template <class T> struct slab_allocator {
+  using value_type = T;
+
+  slab_allocator() = default;
+  template <class U> slab_allocator(const slab_allocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(slab_pool::shared().allocate(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) {
+    slab_pool::shared().deallocate(p, n * sizeof(T));
+  }
+
+  template <class U> void construct(U *p) { ::new (static_cast<void *>(p)) U; }
+  template <class U, class... Args> void construct(U *p, Args &&...args) {
+    ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+  }
+
+  template <class U> bool operator==(const slab_allocator<U> &) const {
+    return true;
+  }
+
+  // see release_cached
+  static void trim() { slab_pool::shared().trim(); }
+};
+
+// after a table shrinks, the arrays it let go of would otherwise sit in its
+// allocator's cache. a no-op for allocators that don't keep one
+template <class Alloc> void release_cached() {
+  if constexpr (requires { Alloc::trim(); })
+    Alloc::trim();
+}
+
+// std::vector<T> through any allocator the engines were given
+template <class T, class Alloc>
+using alloc_vector = std::vector<
+    T, typename std::allocator_traits<Alloc>::template rebind_alloc<T>>;
+
+// what a layout keeps its slots in: a fixed size array from `Alloc`,
+// constructed the way alloc_vector would, that can also borrow its
+// elements from memory it doesn't own (a mapped snapshot, see
+// snapshot.hpp). a borrowed array holds on to `backing` and never destroys
+// or frees what it points at. copies are always owned
+template <class T, class Alloc> class slot_array {
+  using A = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+  using traits = std::allocator_traits<A>;
+
+public:
+  using value_type = T;
+
+  slot_array() = default;
+  explicit slot_array(size_t n) : p(allocate(n)), n(n) {
+    for (size_t i = 0; i < n; i++) {
+      traits::construct(alloc, p + i);
+    }
+  }
+  slot_array(size_t n, const T &v) : p(allocate(n)), n(n) {
+    for (size_t i = 0; i < n; i++) {
+      traits::construct(alloc, p + i, v);
+    }
+  }
+  slot_array(const slot_array &o) : p(allocate(o.n)), n(o.n) {
+    for (size_t i = 0; i < n; i++) {
+      traits::construct(alloc, p + i, o.p[i]);
+    }
+  }
+  slot_array(slot_array &&o) noexcept
+      : p(std::exchange(o.p, nullptr)), n(std::exchange(o.n, 0)),
+        backing(std::move(o.backing)) {}
+  slot_array &operator=(slot_array o) noexcept {
+    std::swap(p, o.p);
+    std::swap(n, o.n);
+    std::swap(backing, o.backing);
+    return *this;
+  }
+  ~slot_array() {
+    if (!p || backing)
+      return;
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      for (size_t i = 0; i < n; i++) {
+        traits::destroy(alloc, p + i);
+      }
+    }
+    traits::deallocate(alloc, p, n);
+  }
+
+  // n elements at p, which stay valid as long as `backing` does
+  static slot_array borrow(T *p, size_t n, std::shared_ptr<void> backing) {
+    slot_array a;
+    a.p = p;
+    a.n = n;
+    a.backing = std::move(backing);
+    return a;
+  }
+
+  size_t size() const { return n; }
+  size_t capacity() const { return n; }
+  T *data() { return p; }
+  const T *data() const { return p; }
+  T &operator[](size_t i) { return p[i]; }
+  const T &operator[](size_t i) const { return p[i]; }
+  T *begin() { return p; }
+  T *end() { return p + n; }
+  const T *begin() const { return p; }
+  const T *end() const { return p + n; }
+
+private:
+  T *allocate(size_t count) {
+    return count ? traits::allocate(alloc, count) : nullptr;
+  }
+
+  [[no_unique_address]] A alloc;
+  T *p = nullptr;
+  size_t n = 0;
+  std::shared_ptr<void> backing;
+};
+
+} // namespace crash
+
+#endif
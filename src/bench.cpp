@@ -1,18 +1,48 @@
+#include <algorithm>
 #include <array>
+#include <barrier>
+#include <bit>
 #include <cassert>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
 #include <optional>
+#include <regex>
+#include <set>
+#include <span>
+#include <sstream>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
 #include "common.hpp"
 #include "crash_multi.hpp"
+#include "hash.hpp"
 #include "linear.hpp"
+#include "numa.hpp"
+#include "perfect.hpp"
 #include "quadratic.hpp"
 #include "robinhood.hpp"
+#include "sharded.hpp"
+#include "static_table.hpp"
+#include "stats.hpp"
+#include "string_key.hpp"
+#include "swiss.hpp"
 
 using namespace std;
 using namespace crash;
@@ -20,13 +50,20 @@ using namespace crash;
 template <class T> inline void doNotOptimizeAway(T &&datum) {
   asm volatile("" : "+r"(datum));
 }
+// everything written through p so far has to really be stored
+inline void escape(const void *p) { asm volatile("" : : "r"(p) : "memory"); }
 template <class M, class K, class V>
 concept Hashtable = requires(M m, const K &k, V v) {
   { m.get(k) } -> same_as<optional<V>>;
   { m.find(k) } -> same_as<V>;
   { m.put(k, v) } -> same_as<void>;
+  {
+    m.get_batch(span<const K>{}, span<optional<V>>{})
+  } -> same_as<void>;
+  { m.put_batch(span<const K>{}, span<const V>{}) } -> same_as<void>;
   { m.erase(k) } -> same_as<void>;
   { m.clear() } -> same_as<void>;
+  { m.reserve(size_t{}) } -> same_as<void>;
   { m.memuse() } -> same_as<uint64_t>; // in bytes
   { m.size() } -> same_as<size_t>;
 };
@@ -36,6 +73,13 @@ concept Generator = requires(G g) {
   { g.get() } -> same_as<T>;
 };
 
+// ids handed out 16 apart, so the low four bits never change. an identity
+// hash (std::hash on libstdc++) only ever lands them on every 16th slot
+template <class I> struct gen_strided {
+  uint64_t next = 0;
+  I get() { return I((next++) << 4); }
+};
+
 template <class K, class V>
   requires Hashable<K>
 class Std_Unordered {
@@ -47,8 +91,19 @@ public:
   }
   V find(const K &k) { return mp[k]; }
   void put(const K &k, V v) { mp[k] = v; }
+  void get_batch(span<const K> ks, span<optional<V>> out) const {
+    for (size_t i = 0; i < ks.size(); i++) {
+      out[i] = get(ks[i]);
+    }
+  }
+  void put_batch(span<const K> ks, span<const V> vs) {
+    for (size_t i = 0; i < ks.size(); i++) {
+      put(ks[i], vs[i]);
+    }
+  }
   void erase(const K &k) { mp.erase(k); }
   void clear() { mp.clear(); }
+  void reserve(size_t n) { mp.reserve(n); }
   uint64_t memuse() {
     return 0; // id ont know lol
   }
@@ -79,47 +134,464 @@ private:
   std::chrono::time_point<std::chrono::high_resolution_clock> start;
 };
 
-template <class M, class K, class V, class G1, class G2, size_t N>
-  requires Hashable<K> && Hashtable<M, K, V> && Generator<G1, K> &&
-           Generator<G2, V>
-map<string, uint64_t> bench() {
-  M m;
-  map<string, uint64_t> results;
+// per-op latencies, log buckets split into 32 linear ones each like
+// HdrHistogram, so every value is kept to within 3% of itself from 1ns up
+class Latency_Histogram {
+public:
+  void add(uint64_t ns) {
+    buckets[index(ns)]++;
+    count++;
+    worst = max(worst, ns);
+  }
+  // upper bound of the bucket holding the q-th quantile
+  uint64_t quantile(double q) const {
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+      seen += buckets[i];
+      if (seen && seen >= q * count)
+        return min(highest(i), worst);
+    }
+    return worst;
+  }
+  uint64_t max_ns() const { return worst; }
+  uint64_t size() const { return count; }
 
-  // probably buffer these...
-  G1 keygen_;
-  G2 valgen_;
+private:
+  static constexpr size_t sub_bits = 5, subs = 1 << sub_bits;
 
-  pcg32 rng(rand(), rand());
+  // below 2 * subs a value is its own bucket, past that each doubling gets
+  // `subs` buckets
+  static size_t index(uint64_t v) {
+    size_t shift = max(bit_width(v), sub_bits + 1) - sub_bits - 1;
+    return subs * shift + (v >> shift);
+  }
+  static uint64_t highest(size_t i) {
+    size_t shift = i < 2 * subs ? 0 : i / subs - 1;
+    return ((i - subs * shift) << shift) + (uint64_t(1) << shift) - 1;
+  }
 
-  unordered_set<K, decltype([](const auto &z) { return z.hash(); })> ks;
-  vector<K> keys(2 * N);
-  vector<V> vals(2 * N);
+  array<uint64_t, subs * (65 - sub_bits)> buckets{};
+  uint64_t count = 0;
+  uint64_t worst = 0;
+};
 
-  while (ks.size() != 2 * N) {
-    ks.insert(keygen_.get());
+// timing single ops with the cycle counter, steady_clock costs too much
+// next to a 20ns get. start() waits for everything before it to finish,
+// stop() for the op, and ticks are turned into ns by a rate measured
+// against steady_clock, less what an empty start()/stop() pair costs.
+// falls back to steady_clock off x86
+class Tsc_Clock {
+public:
+  static uint64_t start() {
+#if defined(__x86_64__)
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+    return now_ns();
+#endif
+  }
+  static uint64_t stop() {
+#if defined(__x86_64__)
+    unsigned aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+#else
+    return now_ns();
+#endif
   }
 
-  {
-    int i = 0;
-    for (const auto &k : ks) {
-      keys[i++] = k;
+  uint64_t ns(uint64_t ticks) const {
+    return ticks > overhead ? (ticks - overhead) * ns_per_tick : 0;
+  }
+  // how many ticks ns takes
+  double ticks(double ns) const { return ns / ns_per_tick; }
+
+  // measured on first use, that takes a few ms
+  static const Tsc_Clock &get() {
+    static const Tsc_Clock clock;
+    return clock;
+  }
+
+private:
+  Tsc_Clock() {
+    auto t0 = chrono::steady_clock::now();
+    uint64_t c0 = start();
+    while (chrono::steady_clock::now() - t0 < chrono::milliseconds(20)) {
+    }
+    uint64_t c1 = stop();
+    double ns = chrono::duration_cast<chrono::nanoseconds>(
+                    chrono::steady_clock::now() - t0)
+                    .count();
+    ns_per_tick = ns / max<uint64_t>(c1 - c0, 1);
+    overhead = ~uint64_t(0);
+    for (int i = 0; i < 100000; i++) {
+      uint64_t s = start();
+      overhead = min(overhead, stop() - s);
+    }
+  }
+  static uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  double ns_per_tick = 1;
+  uint64_t overhead = 0;
+};
+
+// percent of gets, puts and erases, "80/15/5"
+struct Op_Mix {
+  uint32_t get, put, erase;
+
+  static Op_Mix parse(const string &s) {
+    Op_Mix m;
+    char a, b;
+    istringstream in(s);
+    if (!(in >> m.get >> a >> m.put >> b >> m.erase) || a != '/' ||
+        b != '/' || m.get + m.put + m.erase != 100)
+      throw invalid_argument("bad mix " + s + ", want gets/puts/erases");
+    return m;
+  }
+  string name() const {
+    return to_string(get) + "/" + to_string(put) + "/" + to_string(erase);
+  }
+};
+
+// what the command line picked, see usage(). set once in main
+struct Bench_Config {
+  set<string> suites; // all of them when empty
+  vector<string> engines, keys, load_factors;
+  optional<regex> filter;
+  vector<size_t> sizes; // each row's own when empty
+  size_t warmup = 1;
+  size_t reps = 5;
+  uint64_t seed = 42;
+  int cpu = -1;
+  bool perf = false;
+  double rate = 0; // ops per second for the latency suite, 0 is closed loop
+  vector<size_t> threads; // 1, 2, 4 .. cores when empty
+  vector<Op_Mix> mixes = {{95, 5, 0}, {80, 15, 5}, {50, 25, 25}};
+  vector<double> zipf = {0.99};
+  uint64_t duration = 1000; // ms per concurrent run
+  string csv = "out.csv";
+  string json = "out.json";
+
+  bool wants(const string &suite) const {
+    return suites.empty() || suites.count(suite);
+  }
+
+  // rows are named "<Engine> <LF> <Key> <variant>", e.g. "Linear 70 Int Std
+  // Byte Meta". engines match the first word, load factors any word and
+  // keys any run of whole words, all ignoring case
+  bool selects(const string &name) const {
+    string words = " " + lower(name) + " ";
+    auto one_of = [&](const vector<string> &wanted, auto &&match) {
+      return wanted.empty() || any_of(wanted.begin(), wanted.end(), match);
+    };
+    return one_of(engines,
+                  [&](const string &e) {
+                    return words.rfind(" " + lower(e) + " ", 0) == 0;
+                  }) &&
+           one_of(load_factors,
+                  [&](const string &lf) {
+                    return words.find(" " + lf + " ") != string::npos;
+                  }) &&
+           one_of(keys,
+                  [&](const string &k) {
+                    return words.find(" " + lower(k) + " ") != string::npos;
+                  }) &&
+           (!filter || regex_search(name, *filter));
+  }
+
+  static string lower(string s) {
+    for (char &c : s) {
+      c = tolower(c);
+    }
+    return s;
+  }
+};
+Bench_Config config;
+
+// hardware counters for the calling thread through perf_event_open, read as
+// one group so they all cover the same stretch. plenty of machines don't
+// allow it (perf_event_paranoid, containers, VMs without a PMU), open() says
+// why and everything goes on without them
+class Perf_Counters {
+public:
+  static constexpr size_t count = 4;
+  static constexpr const char *names[count] = {"instructions", "cycles",
+                                               "cache_misses", "branch_misses"};
+  using values = array<uint64_t, count>;
+
+  Perf_Counters() { fds.fill(-1); }
+  Perf_Counters(const Perf_Counters &) = delete;
+  Perf_Counters &operator=(const Perf_Counters &) = delete;
+  ~Perf_Counters() { close(); }
+
+  // empty on success, otherwise what went wrong
+  string open() {
+#if defined(__linux__)
+    const uint64_t events[count] = {
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (size_t i = 0; i < count; i++) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = events[i];
+      attr.disabled = i == 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, fds[0], 0);
+      if (fds[i] < 0) {
+        string error = string(names[i]) + ": " + strerror(errno);
+        close();
+        return error;
+      }
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return "";
+#else
+    return "perf_event_open is linux only";
+#endif
+  }
+  bool enabled() const { return fds[0] >= 0; }
+
+  // running totals since open()
+  values read() const {
+    struct {
+      uint64_t n;
+      uint64_t v[count];
+    } group{};
+    values out{};
+    if (enabled() && ::read(fds[0], &group, sizeof(group)) > 0)
+      copy(begin(group.v), end(group.v), out.begin());
+    return out;
+  }
+
+private:
+  void close() {
+    for (int &fd : fds) {
+      if (fd >= 0)
+        ::close(fd);
+      fd = -1;
+    }
+  }
+
+  array<int, count> fds;
+};
+Perf_Counters perf;
+
+// one number out of a run of bench()
+struct Sample {
+  double value;
+  const char *unit;
+};
+
+// times one phase of bench() into results[n] as ns per op, with each perf
+// counter per op next to it when they're on
+class Phase {
+public:
+  Phase(map<string, Sample> &results, string n, uint64_t ops)
+      : results(results), n(std::move(n)), ops(max<uint64_t>(ops, 1)) {
+    counters = perf.read();
+    start = chrono::steady_clock::now();
+  }
+  Phase(const Phase &) = delete;
+  ~Phase() {
+    auto end = chrono::steady_clock::now();
+    auto after = perf.read();
+    double ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+    results[n] = {ns / ops, "ns/op"};
+    if (!perf.enabled())
+      return;
+    for (size_t i = 0; i < Perf_Counters::count; i++) {
+      results[n + "_" + Perf_Counters::names[i]] = {
+          double(after[i] - counters[i]) / ops, "per op"};
+    }
+  }
+
+private:
+  map<string, Sample> &results;
+  string n;
+  uint64_t ops;
+  Perf_Counters::values counters;
+  chrono::steady_clock::time_point start;
+};
+
+// every rep of every row of the main suite, summed up as median, p5 and p95
+// per metric. CSV rows go out as each row finishes, the JSON at the end
+class Bench_Report {
+public:
+  Bench_Report(const string &csv_path) : csv(csv_path) {
+    csv << "name, keys, metric, unit, reps, median, p5, p95\n";
+  }
+
+  void add(const string &n, size_t keys,
+           const vector<map<string, Sample>> &runs) {
+    if (runs.empty())
+      return;
+    for (const auto &[metric, first] : runs[0]) {
+      row r{n, keys, metric, first.unit, {}};
+      for (const auto &run : runs) {
+        r.samples.push_back(run.at(metric).value);
+      }
+      sort(r.samples.begin(), r.samples.end());
+      csv << n << ", " << keys << ", " << metric << ", " << r.unit << ", "
+          << r.samples.size() << ", " << r.quantile(0.5) << ", "
+          << r.quantile(0.05) << ", " << r.quantile(0.95) << "\n";
+      // the spread is what a difference between two runs has to beat
+      if (string(r.unit) == "ns/op")
+        cerr << "  " << metric << ": " << r.quantile(0.5) << " ns/op, p5-p95 "
+             << spread(r) << "%\n";
+      rows.push_back(std::move(r));
     }
+    csv.flush();
   }
 
-  for (int i = 0; i < 2 * N; i++) {
-    vals[i] = valgen_.get();
+  void write_json(const string &path) const {
+    ofstream out(path);
+    out << "{\n  \"config\": {\"warmup\": " << config.warmup
+        << ", \"reps\": " << config.reps << ", \"seed\": " << config.seed
+        << ", \"cpu\": " << config.cpu
+        << ", \"perf\": " << (perf.enabled() ? "true" : "false")
+        << "},\n  \"results\": [";
+    for (size_t i = 0; i < rows.size(); i++) {
+      const row &r = rows[i];
+      out << (i ? ",\n" : "\n") << "    {\"name\": \"" << escape(r.name)
+          << "\", \"keys\": " << r.keys << ", \"metric\": \"" << r.metric
+          << "\", \"unit\": \"" << r.unit
+          << "\", \"median\": " << r.quantile(0.5)
+          << ", \"p5\": " << r.quantile(0.05)
+          << ", \"p95\": " << r.quantile(0.95) << ", \"samples\": [";
+      for (size_t j = 0; j < r.samples.size(); j++) {
+        out << (j ? ", " : "") << r.samples[j];
+      }
+      out << "]}";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+private:
+  struct row {
+    string name;
+    size_t keys;
+    string metric;
+    const char *unit;
+    vector<double> samples; // sorted
+
+    // linear between the two closest samples
+    double quantile(double q) const {
+      double at = q * (samples.size() - 1);
+      size_t i = at;
+      if (i + 1 >= samples.size())
+        return samples.back();
+      return samples[i] + (at - i) * (samples[i + 1] - samples[i]);
+    }
+  };
+
+  static double spread(const row &r) {
+    double mid = r.quantile(0.5);
+    return mid ? (r.quantile(0.95) - r.quantile(0.05)) / mid * 100 : 0;
+  }
+  static string escape(const string &s) {
+    string out;
+    for (char c : s) {
+      if (c == '"' || c == '\\')
+        out += '\\';
+      out += c;
+    }
+    return out;
   }
-  uint64_t _ = 0;
 
-  auto make_clock = [&results](string n) {
-    return Clock([&results, n](uint64_t ns) { results[n] = ns; });
+  ofstream csv;
+  vector<row> rows;
+};
+
+// the shape of `m` and its probe counters, next to the timings. zero for
+// tables without stats(). the counters are only there when built with
+// -DCRASH_STATS, which slows every op down a bit, so take timings from a
+// build without it
+template <class M>
+void record_stats(map<string, Sample> &results, const M &m) {
+  table_stats s;
+  if constexpr (requires { m.stats(); })
+    s = m.stats();
+  auto probes = [&results](string n, const probe_histogram &h) {
+    results["stats_" + n + "_avg"] = {h.average(), "slots"};
+    results["stats_" + n + "_p99"] = {double(h.quantile(0.99)), "slots"};
+    results["stats_" + n + "_max"] = {double(h.longest), "slots"};
+    // the histogram, 1 | 2-3 | 4-7 | 8-15 | 16 and up
+    uint64_t rest = h.count;
+    for (size_t i = 1; i < 5; i++) {
+      results["stats_" + n + "_" + to_string(1 << (i - 1))] = {
+          double(h.buckets[i]), "probes"};
+      rest -= h.buckets[i];
+    }
+    results["stats_" + n + "_16_up"] = {double(rest), "probes"};
+  };
+  probes("hit_probe", s.hits);
+  probes("miss_probe", s.misses);
+  results["stats_displacement_avg"] = {s.avg_displacement, "slots"};
+  results["stats_displacement_max"] = {double(s.max_displacement), "slots"};
+  results["stats_tombstone_ratio"] = {s.tombstone_ratio(), "ratio"};
+  results["stats_longest_cluster"] = {double(s.longest_cluster), "slots"};
+  results["stats_resizes"] = {double(s.resizes), "count"};
+  results["stats_resize_ns"] = {double(s.resize_ns), "ns"};
+}
+
+// one run over N = keys.size() / 2 keys, the first N go in and the rest
+// are misses. every phase is ns per op
+template <class M, class K, class V>
+  requires Hashable<K> && Hashtable<M, K, V>
+map<string, Sample> bench(const vector<K> &keys, const vector<V> &vals,
+                          uint64_t seed) {
+  const size_t N = keys.size() / 2;
+  M m;
+  map<string, Sample> results;
+  pcg32 rng(seed, 1);
+
+  auto make_clock = [&results](string n, uint64_t ops) {
+    return Phase(results, n, ops);
   };
 
+  {
+    // every put timed on its own, a resize lands in the tail
+    M tbl;
+    Latency_Histogram hist;
+    for (size_t i = 0; i < N; i++) {
+      auto start = chrono::steady_clock::now();
+      tbl.put(keys[i], vals[i]);
+      hist.add(chrono::duration_cast<chrono::nanoseconds>(
+                   chrono::steady_clock::now() - start)
+                   .count());
+    }
+    results["insert_N_latency_p50"] = {double(hist.quantile(0.5)), "ns"};
+    results["insert_N_latency_p99"] = {double(hist.quantile(0.99)), "ns"};
+    results["insert_N_latency_p9999"] = {double(hist.quantile(0.9999)),
+                                         "ns"};
+    results["insert_N_latency_max"] = {double(hist.max_ns()), "ns"};
+  }
+
+  {
+    // same keys with every resize done up front
+    M tbl;
+    tbl.reserve(N);
+    auto c = make_clock("insert_N_presized", N);
+    for (size_t i = 0; i < N; i++) {
+      tbl.put(keys[i], vals[i]);
+    }
+  }
+
   // can't "fix" the load factor here
   {
-    auto c = make_clock("insert_N");
-    for (int i = 0; i < N; i++) {
+    auto c = make_clock("insert_N", N);
+    for (size_t i = 0; i < N; i++) {
       m.put(keys[i], vals[i]);
     }
   }
@@ -127,8 +599,8 @@ map<string, uint64_t> bench() {
   const int num_bench = 1000000;
   const int num_erase = 1000;
   {
-    auto c = make_clock("get_N_present");
-    int idx = 0;
+    auto c = make_clock("get_N_present", num_bench);
+    size_t idx = 0;
     for (int i = 0; i < num_bench; i++) {
       auto x = m.get(keys[idx]);
       doNotOptimizeAway(*x);
@@ -138,8 +610,8 @@ map<string, uint64_t> bench() {
     }
   }
   {
-    auto c = make_clock("find_N_present");
-    int idx = 0;
+    auto c = make_clock("find_N_present", num_bench);
+    size_t idx = 0;
     for (int i = 0; i < num_bench; i++) {
       auto x = m.find(keys[idx]);
       doNotOptimizeAway(x);
@@ -149,7 +621,7 @@ map<string, uint64_t> bench() {
     }
   }
   {
-    auto c = make_clock("get_N_present_random");
+    auto c = make_clock("get_N_present_random", num_bench);
     for (int i = 0; i < num_bench; i++) {
       int z = rng.get() % N;   // the modulo is slow
       auto x = m.get(keys[z]); // cache miss here
@@ -157,8 +629,36 @@ map<string, uint64_t> bench() {
     }
   }
   {
-    auto c = make_clock("get_N_missing");
-    int idx = 0;
+    // same access pattern as a request handler looking up a group of keys
+    const int batch = 64;
+    vector<K> picked(num_bench);
+    vector<V> picked_vals(num_bench);
+    vector<optional<V>> out(batch);
+    for (int i = 0; i < num_bench; i++) {
+      int z = rng.get() % N;
+      picked[i] = keys[z];
+      picked_vals[i] = vals[z];
+    }
+    {
+      auto c = make_clock("get_N_present_random_batch",
+                          num_bench / batch * batch);
+      for (int i = 0; i + batch <= num_bench; i += batch) {
+        m.get_batch(span<const K>(&picked[i], batch), out);
+        doNotOptimizeAway(*out[0]);
+      }
+    }
+    {
+      auto c = make_clock("put_N_present_random_batch",
+                          num_bench / batch * batch);
+      for (int i = 0; i + batch <= num_bench; i += batch) {
+        m.put_batch(span<const K>(&picked[i], batch),
+                    span<const V>(&picked_vals[i], batch));
+      }
+    }
+  }
+  {
+    auto c = make_clock("get_N_missing", num_bench);
+    size_t idx = 0;
     for (int i = 0; i < num_bench; i++) {
       auto x = m.get(keys[N + idx++]);
       doNotOptimizeAway(*x);
@@ -167,7 +667,7 @@ map<string, uint64_t> bench() {
     }
   }
   {
-    auto c = make_clock("get_N_missing_random");
+    auto c = make_clock("get_N_missing_random", num_bench);
     for (int i = 0; i < num_bench; i++) {
       int z = rng.get() % N;
       auto x = m.get(keys[N + z]);
@@ -175,22 +675,23 @@ map<string, uint64_t> bench() {
     }
   }
   {
-    auto c = make_clock("get_N_mixed_50");
+    auto c = make_clock("get_N_mixed_50", num_bench);
     for (int i = 0; i < num_bench; i++) {
       int z = rng.get() % (2 * N);
       auto x = m.get(keys[z]);
       doNotOptimizeAway(*x);
     }
   }
+  record_stats(results, m);
 
   // get erase indices
 
-  const int erase_task = 10000;
+  const size_t erase_task = min<size_t>(10000, N);
   {
     auto tbl = m;
     {
-      auto c = make_clock("erase_N_present");
-      for (int i = 0; i < erase_task; i++) {
+      auto c = make_clock("erase_N_present", erase_task);
+      for (size_t i = 0; i < erase_task; i++) {
         tbl.erase(keys[i]);
       }
     }
@@ -198,8 +699,8 @@ map<string, uint64_t> bench() {
   {
     auto tbl = m;
     {
-      auto c = make_clock("erase_N_mixed_50");
-      for (int i = 0; i < erase_task; i++) {
+      auto c = make_clock("erase_N_mixed_50", erase_task);
+      for (size_t i = 0; i < erase_task; i++) {
         int z = rng.get() % (2 * N);
         tbl.erase(keys[z]);
       }
@@ -208,117 +709,1490 @@ map<string, uint64_t> bench() {
 
   // uhhh this may be useless
   {
-    auto c = make_clock("clear");
+    auto c = make_clock("clear", 1);
     m.clear();
   }
   return results;
 }
 
-template <class M, class K, class V, class G1, class G2, size_t N>
+// `warmup` runs thrown away, then `reps` more over the same 2N keys and the
+// same seed, so they only differ by noise
+template <class M, class K, class V, class G1, class G2>
   requires Hashable<K> && Hashtable<M, K, V> && Generator<G1, K> &&
            Generator<G2, V>
-void do_bench(string n, ostream &stream) {
-  cerr << "BEGIN " << n << "\n------------------\n";
-  stream << n;
-  auto z = bench<M, K, V, G1, G2, N>();
-  for (const auto &[name, val] : z) {
-    stream << ", " << val;
-  }
-  stream << "\n";
-  cerr << "\n------------------\n"
-       << "END " << n << "\n";
+void do_bench(const string &n, size_t N, Bench_Report &report) {
+  cerr << "BEGIN " << n << ", " << N << " keys\n";
+  G1 keygen_;
+  G2 valgen_;
+  unordered_set<K, decltype([](const auto &z) { return z.hash(); })> ks;
+  while (ks.size() != 2 * N) {
+    ks.insert(keygen_.get());
+  }
+  vector<K> keys(ks.begin(), ks.end());
+  vector<V> vals(2 * N);
+  for (auto &v : vals) {
+    v = valgen_.get();
+  }
+  ks.clear();
+
+  vector<map<string, Sample>> runs;
+  for (size_t r = 0; r < config.warmup + config.reps; r++) {
+    auto z = bench<M, K, V>(keys, vals, config.seed);
+    if (r >= config.warmup)
+      runs.push_back(std::move(z));
+  }
+  report.add(n, N, runs);
+  cerr << "END " << n << "\n";
 }
 
-int main() {
+// average and worst number of slots (groups, for swiss) an insert looks at
+// when `hashes` go into a table of `capacity` slots with `probe`'s scheme
+template <class Probe>
+pair<double, size_t> probe_lengths(const vector<size_t> &hashes,
+                                   size_t capacity, Probe &&probe) {
+  vector<bool> used(capacity);
+  size_t total = 0, worst = 0;
+  for (size_t h : hashes) {
+    size_t n = probe(used, h);
+    total += n;
+    worst = max(worst, n);
+  }
+  return {double(total) / hashes.size(), worst};
+}
+
+// how evenly a hash spreads `keys` under each engine's probe scheme at LF
+// 0.7, and what it costs per key
+template <class K>
+void hash_quality(string n, const vector<K> &keys, ostream &stream) {
+  vector<size_t> hashes(keys.size());
+  uint64_t ns;
+  {
+    Clock c([&ns](uint64_t t) { ns = t; });
+    for (size_t i = 0; i < keys.size(); i++) {
+      hashes[i] = keys[i].hash();
+    }
+  }
+  const size_t capacity = bit_ceil(keys.size() * 10 / 7);
+  const size_t mask = capacity - 1;
+  const size_t group = 16;
+
+  auto linear = [&](vector<bool> &used, size_t h) {
+    size_t n = 1;
+    for (h &= mask; used[h]; n++) {
+      h = (h + 1) & mask;
+    }
+    used[h] = true;
+    return n;
+  };
+  auto triangular = [&](vector<bool> &used, size_t h) {
+    size_t n = 1;
+    for (h &= mask; used[h]; n++) {
+      h = (h + n) & mask;
+    }
+    used[h] = true;
+    return n;
+  };
+  // groups of 16 picked by the bits above the 7 bit tag, like swiss
+  auto groups = [&](vector<bool> &used, size_t h) {
+    size_t groups = capacity / group;
+    size_t g = (h >> 7) & (groups - 1);
+    for (size_t n = 1;; n++) {
+      for (size_t i = 0; i < group; i++) {
+        if (!used[g * group + i]) {
+          used[g * group + i] = true;
+          return n;
+        }
+      }
+      g = (g + n) & (groups - 1);
+    }
+  };
+
+  double per_key = double(ns) / keys.size();
+  for (auto [scheme, lengths] :
+       {pair{"linear", probe_lengths(hashes, capacity, linear)},
+        pair{"triangular", probe_lengths(hashes, capacity, triangular)},
+        pair{"swiss groups", probe_lengths(hashes, capacity, groups)}}) {
+    stream << n << ", " << scheme << ", " << per_key << ", " << lengths.first
+           << ", " << lengths.second << "\n";
+  }
+}
+
+template <class K, class G> void do_hash_quality(string n, ostream &stream) {
+  const size_t num_keys = 1 << 20;
+  G keygen_;
+  vector<K> random_keys(num_keys), sequential_keys(num_keys);
+  for (size_t i = 0; i < num_keys; i++) {
+    random_keys[i] = keygen_.get();
+    // ids that only differ in their last few characters
+    sequential_keys[i] = K("user:" + to_string(i));
+  }
+  hash_quality(n + " random", random_keys, stream);
+  hash_quality(n + " sequential", sequential_keys, stream);
+}
+
+// ranks below n with P(i) proportional to 1 / (i + 1)^theta, the YCSB way
+// (Gray et al., "Quickly generating billion-record synthetic databases").
+// rank 0 is the hottest. theta has to be below 1
+class Zipf {
+public:
+  Zipf(size_t n, double theta) : n(n), theta(theta) {
+    for (size_t i = 1; i <= n; i++) {
+      zetan += 1 / pow(double(i), theta);
+    }
+    double zeta2 = 1 + 1 / pow(2.0, theta);
+    alpha = 1 / (1 - theta);
+    eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+  }
+  size_t operator()(pcg32 &rng) const {
+    double u = rng.get() / 4294967296.0;
+    double uz = u * zetan;
+    if (uz < 1)
+      return 0;
+    if (uz < 1 + pow(0.5, theta))
+      return 1;
+    return min<size_t>(n - 1, n * pow(eta * u - eta + 1, alpha));
+  }
+
+private:
+  size_t n;
+  double theta, zetan = 0, alpha, eta;
+};
+
+// keeps the calling thread on the `cpu`th of the cpus it may run on, modulo
+// how many that is. so taskset and numactl --cpunodebind still hold
+void pin_thread(size_t cpu) {
+#if defined(__linux__)
+  cpu_set_t allowed, one;
+  pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+  size_t skip = cpu % max(1, CPU_COUNT(&allowed));
+  CPU_ZERO(&one);
+  for (size_t c = 0; c < CPU_SETSIZE; c++) {
+    if (CPU_ISSET(c, &allowed) && !skip--) {
+      CPU_SET(c, &one);
+      break;
+    }
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+#endif
+}
+
+struct Mixed_Result {
+  double seconds;
+  vector<double> ops_per_sec; // each thread's
+  uint64_t ops;
+};
+
+// `threads` threads doing `mix` on keys drawn by `zipf` (uniform without)
+// over a table that starts with half of `keys` in it, for `ms`. every
+// thread is pinned, draws its ops up front so the loop is only table ops,
+// and starts from the same barrier
+template <class M, class K>
+Mixed_Result bench_mixed(size_t threads, const vector<K> &keys, Op_Mix mix,
+                         const optional<Zipf> &zipf, uint64_t ms) {
+  const size_t stream = 1 << 20; // ops each thread draws, then loops over
+  M m;
+  for (size_t i = 0; i < keys.size() / 2; i++) {
+    m.put(keys[i], i);
+  }
+
+  barrier start(threads + 1);
+  atomic<bool> stop = false;
+  vector<uint64_t> done(threads);
+  vector<double> busy(threads);
+  vector<thread> ts;
+  for (size_t t = 0; t < threads; t++) {
+    ts.emplace_back([&, t]() {
+      pin_thread(t);
+      pcg32 rng(config.seed, t + 1);
+      // the key's index, the kind of op in the top two bits
+      vector<uint32_t> ops(stream);
+      for (auto &op : ops) {
+        uint32_t pick = rng.get() % 100;
+        uint32_t kind = pick < mix.get ? 0 : pick < mix.get + mix.put ? 1 : 2;
+        size_t k = zipf ? (*zipf)(rng) : rng.get() % keys.size();
+        op = k | kind << 30;
+      }
+      start.arrive_and_wait();
+      auto t0 = chrono::steady_clock::now();
+      uint64_t n = 0;
+      while (!stop.load(memory_order_relaxed)) {
+        for (size_t j = 0; j < 256; j++, n++) {
+          uint32_t op = ops[n & (stream - 1)];
+          const K &k = keys[op & ((1 << 30) - 1)];
+          if (op >> 30 == 0) {
+            auto x = m.get(k);
+            doNotOptimizeAway(x.has_value());
+          } else if (op >> 30 == 1) {
+            m.put(k, n);
+          } else {
+            m.erase(k);
+          }
+        }
+      }
+      busy[t] = chrono::duration<double>(chrono::steady_clock::now() - t0)
+                    .count();
+      done[t] = n;
+    });
+  }
+  start.arrive_and_wait();
+  auto t0 = chrono::steady_clock::now();
+  this_thread::sleep_for(chrono::milliseconds(ms));
+  stop.store(true, memory_order_relaxed);
+  for (auto &t : ts) {
+    t.join();
+  }
+  Mixed_Result r;
+  r.seconds = chrono::duration<double>(chrono::steady_clock::now() - t0)
+                  .count();
+  r.ops = 0;
+  for (size_t t = 0; t < threads; t++) {
+    r.ops += done[t];
+    r.ops_per_sec.push_back(done[t] / busy[t]);
+  }
+  return r;
+}
+
+// every op mix, uniform and every zipf theta, over every thread count.
+// throughput is all threads' ops over the wall time, scaling is against the
+// first thread count. fairness is Jain's index over each thread's ops/sec,
+// 1 when they all got the same share, 1/threads when one got everything
+template <class M, class K, class G>
+void do_bench_mixed(string n, ostream &stream) {
+  const size_t num_keys = 1 << 20;
+  G keygen_;
+  vector<K> keys(num_keys);
+  for (auto &k : keys) {
+    k = keygen_.get();
+  }
+  vector<size_t> threads = config.threads;
+  if (threads.empty()) {
+    size_t cores = max(1u, thread::hardware_concurrency());
+    for (size_t t = 1; t < cores; t *= 2) {
+      threads.push_back(t);
+    }
+    threads.push_back(cores);
+  }
+  vector<optional<Zipf>> dists = {nullopt};
+  for (double theta : config.zipf) {
+    dists.emplace_back(in_place, num_keys, theta);
+  }
+
+  // the first run after making the keys is always slow, throw one away
+  bench_mixed<M, K>(threads[0], keys, config.mixes[0], nullopt,
+                    config.duration / 4);
+  for (const Op_Mix &mix : config.mixes) {
+    for (size_t d = 0; d < dists.size(); d++) {
+      ostringstream dist;
+      dist << "zipf " << (d ? config.zipf[d - 1] : 0);
+      if (!d)
+        dist.str("uniform");
+      double base = 0;
+      for (size_t t : threads) {
+        cerr << "BEGIN " << n << " " << mix.name() << " " << dist.str() << " "
+             << t << " threads\n";
+        auto r = bench_mixed<M, K>(t, keys, mix, dists[d], config.duration);
+        double mops = r.ops / r.seconds / 1e6;
+        if (!base)
+          base = mops;
+        double sum = 0, squares = 0;
+        for (double x : r.ops_per_sec) {
+          sum += x;
+          squares += x * x;
+        }
+        auto [lo, hi] = minmax_element(r.ops_per_sec.begin(),
+                                       r.ops_per_sec.end());
+        stream << n << ", " << mix.name() << ", " << dist.str() << ", " << t
+               << ", " << mops << ", " << mops / base << ", " << *lo / 1e6
+               << ", " << *hi / 1e6 << ", " << sum * sum / (t * squares)
+               << "\n";
+      }
+    }
+  }
+}
+
+// what the ebr guard on every op costs readers: the same concurrent table
+// with ebr_reclaim and with deferred_reclaim, which has no guards and frees
+// nothing until it goes, doing only gets. 1 to 64 threads unless --threads
+// says otherwise, more threads than cores shows what preemption inside a
+// guard does
+template <class K, class V, class G>
+void do_bench_reclaim(string n, ostream &stream) {
+  using guarded = concurrent_hashtable<K, V, slab_allocator<K>, ebr_reclaim>;
+  using unguarded =
+      concurrent_hashtable<K, V, slab_allocator<K>, deferred_reclaim>;
+  const size_t num_keys = 1 << 20;
+  G keygen_;
+  vector<K> keys(num_keys);
+  for (auto &k : keys) {
+    k = keygen_.get();
+  }
+  vector<size_t> threads = config.threads;
+  if (threads.empty())
+    threads = {1, 2, 4, 8, 16, 32, 64};
+  Op_Mix reads = {100, 0, 0};
+
+  bench_mixed<guarded, K>(threads[0], keys, reads, nullopt,
+                          config.duration / 4);
+  for (size_t t : threads) {
+    cerr << "BEGIN " << n << " " << t << " threads\n";
+    auto g = bench_mixed<guarded, K>(t, keys, reads, nullopt, config.duration);
+    auto u =
+        bench_mixed<unguarded, K>(t, keys, reads, nullopt, config.duration);
+    double with = g.ops / g.seconds / 1e6, without = u.ops / u.seconds / 1e6;
+    stream << n << ", " << t << ", " << with << ", " << without << ", "
+           << (without / with - 1) * 100 << "\n";
+  }
+}
+
+enum class Placement { local, remote, interleaved };
+
+// a concurrent table with its slots on the node the bench runs on, on
+// another one, or spread over all of them
+template <class K, class V, Placement P>
+struct Numa_Placed : concurrent_hashtable<K, V, numa_allocator<K>> {
+  Numa_Placed()
+      : concurrent_hashtable<K, V, numa_allocator<K>>(
+            16, numa_allocator<K>(node())) {}
+  static int node() {
+    if (P == Placement::interleaved)
+      return numa_interleave;
+    size_t here = numa_node();
+    return int(P == Placement::local ? here : (here + 1) % numa_nodes());
+  }
+};
+
+// gets from every thread against the same keys in tables placed every way
+// numa.hpp has: on this node, on the next node, where the process's policy
+// puts it (so numactl --membind picks), interleaved, sharded by node and
+// replicated per node. local and remote are relative to the node the bench
+// starts on, run it under numactl --cpunodebind so the readers stay there.
+// on one node remote is local again, and everything should come out even
+template <class K, class V, class G>
+void do_bench_numa(string n, ostream &stream) {
+  const size_t num_keys = 1 << 21;
+  G keygen_;
+  vector<K> keys(num_keys);
+  for (auto &k : keys) {
+    k = keygen_.get();
+  }
+  vector<size_t> threads = config.threads;
+  if (threads.empty()) {
+    size_t cores = max(1u, thread::hardware_concurrency());
+    for (size_t t = 1; t < cores; t *= 2) {
+      threads.push_back(t);
+    }
+    threads.push_back(cores);
+  }
+  if (numa_nodes() == 1)
+    cerr << "one numa node, remote is local\n";
+  Op_Mix reads = {100, 0, 0};
+  using run = Mixed_Result (*)(size_t, const vector<K> &, Op_Mix,
+                               const optional<Zipf> &, uint64_t);
+  vector<pair<string, run>> placements = {
+      {"local", bench_mixed<Numa_Placed<K, V, Placement::local>, K>},
+      {"remote", bench_mixed<Numa_Placed<K, V, Placement::remote>, K>},
+      {"default", bench_mixed<concurrent_hashtable<K, V>, K>},
+      {"interleaved",
+       bench_mixed<Numa_Placed<K, V, Placement::interleaved>, K>},
+      {"sharded", bench_mixed<numa_sharded<K, V>, K>},
+      {"replicated", bench_mixed<numa_replicated<K, V>, K>},
+  };
+
+  bench_mixed<concurrent_hashtable<K, V>, K>(threads[0], keys, reads, nullopt,
+                                             config.duration / 4);
+  for (size_t t : threads) {
+    double local = 0;
+    for (const auto &[where, fn] : placements) {
+      cerr << "BEGIN " << n << " " << where << " " << t << " threads\n";
+      auto r = fn(t, keys, reads, nullopt, config.duration);
+      double mops = r.ops / r.seconds / 1e6;
+      if (!local)
+        local = mops;
+      stream << n << ", " << where << ", " << t << ", " << mops << ", "
+             << mops / local << "\n";
+    }
+  }
+}
+
+// session ids as keys, for the churn bench
+struct make_int {
+  i64 operator()(uint64_t i) const { return i64(i); }
+};
+struct make_fast_string {
+  FastString operator()(uint64_t i) const {
+    return FastString("session:" + to_string(i));
+  }
+};
+
+// a working set of `live` session keys: each cycle erases the oldest key and
+// inserts a fresh one, so size() never moves. time per cycle and memuse()
+// should stay flat from round to round, a table that only ever leaves
+// tombstones behind keeps growing and probing further instead. cycles are
+// timed one by one for the tail, so ns per cycle includes the clock reads
+template <class M, class K, class Make>
+void do_bench_churn(string n, ostream &stream) {
+  const uint64_t live = 1 << 20;
+  const size_t rounds = 10;
+  const size_t cycles = 1 << 20; // per round
+  Make make;
+  M m;
+  for (uint64_t i = 0; i < live; i++) {
+    m.put(make(i), i);
+  }
+  cerr << "BEGIN " << n << " churn\n";
+  uint64_t next = live;
+  for (size_t r = 0; r < rounds; r++) {
+    Latency_Histogram hist;
+    uint64_t ns;
+    {
+      Clock c([&ns](uint64_t x) { ns = x; });
+      for (size_t i = 0; i < cycles; i++, next++) {
+        K gone = make(next - live);
+        K fresh = make(next);
+        auto start = chrono::steady_clock::now();
+        m.erase(gone);
+        m.put(fresh, next);
+        hist.add(chrono::duration_cast<chrono::nanoseconds>(
+                     chrono::steady_clock::now() - start)
+                     .count());
+      }
+    }
+    double tombstones = 0;
+    if constexpr (requires { m.stats(); })
+      tombstones = m.stats().tombstone_ratio();
+    stream << n << ", " << r << ", " << ns / cycles << ", "
+           << hist.quantile(0.99) << ", " << hist.max_ns() << ", " << m.size()
+           << ", " << m.memuse() << ", " << tombstones << "\n";
+  }
+}
+
+// resident set size of the whole process, 0 where there's no /proc
+uint64_t rss_bytes() {
+  ifstream statm("/proc/self/statm");
+  uint64_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// a batch window: the table spikes to `peak` keys, then drops to `keep`.
+// once with an explicit shrink_to_fit, once with a low water mark. rss is
+// for the whole process, so the rows only mean something next to each other
+template <class M, class K, class Make>
+void do_bench_shrink(string n, ostream &stream) {
+  const uint64_t peak = 10000000;
+  const uint64_t keep = 10000;
+  Make make;
+  auto report = [&](const string &phase, const M &m) {
+    stream << n << ", " << phase << ", " << m.size() << ", " << m.memuse()
+           << ", " << (rss_bytes() >> 20) << "\n";
+  };
+  auto spike = [&](M &m) {
+    for (uint64_t i = 0; i < peak; i++) {
+      m.put(make(i), i);
+    }
+    report("peak", m);
+    for (uint64_t i = keep; i < peak; i++) {
+      m.erase(make(i));
+    }
+  };
+  cerr << "BEGIN " << n << " shrink\n";
+  slab_pool::shared().trim();
+  {
+    M m;
+    report("start", m);
+    spike(m);
+    report("drained", m);
+    uint64_t ns;
+    {
+      Clock c([&ns](uint64_t x) { ns = x; });
+      m.shrink_to_fit();
+    }
+    report("shrink_to_fit " + to_string(ns / 1000) + "us", m);
+  }
+  {
+    M m;
+    m.set_low_water(0.125);
+    spike(m);
+    report("drained with low water", m);
+  }
+}
+
+// a small hot map holding `N` keys, hit over and over like a per-request
+// lookup would. static_table keeps everything inline, the rest go through
+// their heap arrays. ns per op, lookup order precomputed
+template <class M, size_t N> void do_bench_small(string n, ostream &stream) {
+  if (!config.selects(n + " Int"))
+    return;
+  const size_t ops = 10000000;
+  const size_t order_size = 1 << 16;
+  gen_int keygen_;
+  set<uint64_t> seen;
+  vector<i64> keys;
+  while (keys.size() < 2 * N) {
+    i64 k = keygen_.get();
+    if (seen.insert(k.i).second)
+      keys.push_back(k);
+  }
+  pcg32 rng(5, 11);
+  vector<uint32_t> order(order_size);
+  for (auto &o : order) {
+    o = rng.get() % N;
+  }
+
+  M m;
+  if constexpr (requires { m.reserve(N); })
+    m.reserve(N);
+  for (size_t i = 0; i < N; i++) {
+    m.put(keys[i], i);
+  }
+  uint64_t hit, miss, update;
+  {
+    Clock c([&hit](uint64_t ns) { hit = ns; });
+    for (size_t i = 0; i < ops; i++) {
+      auto x = m.get(keys[order[i & (order_size - 1)]]);
+      doNotOptimizeAway(*x);
+    }
+  }
+  {
+    Clock c([&miss](uint64_t ns) { miss = ns; });
+    for (size_t i = 0; i < ops; i++) {
+      auto x = m.get(keys[N + order[i & (order_size - 1)]]);
+      doNotOptimizeAway(x.has_value());
+    }
+  }
+  {
+    Clock c([&update](uint64_t ns) { update = ns; });
+    for (size_t i = 0; i < ops; i++) {
+      m.put(keys[order[i & (order_size - 1)]], i);
+    }
+    // an inline table that's never read again could skip the stores
+    escape(&m);
+  }
+  stream << n << ", " << N << ", " << double(hit) / ops << ", "
+         << double(miss) / ops << ", " << double(update) / ops << "\n";
+}
+
+template <size_t N> void do_bench_small_sizes(ostream &stream) {
+  cerr << "BEGIN small " << N << "\n";
+  do_bench_small<static_table<i64, uint64_t, N>, N>("Static", stream);
+  do_bench_small<linear<i64, uint64_t, 70>, N>("Linear 70", stream);
+  do_bench_small<robinhood<i64, uint64_t, 70>, N>("Robinhood 70", stream);
+  do_bench_small<swiss<i64, uint64_t, 90>, N>("Swiss 90", stream);
+}
+
+// a finished `M` with N keys against the perfect_table frozen from it, on
+// the same get_N_present_random / get_N_missing_random loops as bench().
+// one row each, ns per op, build time is the freeze
+template <class M, class K, class G, size_t N>
+void do_bench_frozen(string n, ostream &stream) {
+  const int num_bench = 1000000;
+  cerr << "BEGIN " << n << " frozen\n";
+  G keygen_;
+  unordered_set<K, decltype([](const auto &z) { return z.hash(); })> ks;
+  while (ks.size() != 2 * N) {
+    ks.insert(keygen_.get());
+  }
+  vector<K> keys(ks.begin(), ks.end());
+  M m;
+  for (size_t i = 0; i < N; i++) {
+    m.put(keys[i], i);
+  }
+  uint64_t build;
+  optional<perfect_table<K, uint64_t>> frozen;
+  {
+    Clock c([&build](uint64_t ns) { build = ns; });
+    frozen.emplace(m);
+  }
+
+  pcg32 rng(config.seed, 1);
+  auto run = [&](const string &table, const auto &t, uint64_t build_ns) {
+    uint64_t present, missing;
+    {
+      Clock c([&present](uint64_t ns) { present = ns; });
+      for (int i = 0; i < num_bench; i++) {
+        int z = rng.get() % N;
+        auto x = t.get(keys[z]);
+        doNotOptimizeAway(*x);
+      }
+    }
+    {
+      Clock c([&missing](uint64_t ns) { missing = ns; });
+      for (int i = 0; i < num_bench; i++) {
+        int z = rng.get() % N;
+        auto x = t.get(keys[N + z]);
+        doNotOptimizeAway(x.has_value());
+      }
+    }
+    stream << n << ", " << table << ", " << N << ", " << build_ns / 1000000
+           << ", " << t.memuse() << ", " << double(present) / num_bench
+           << ", " << double(missing) / num_bench << "\n";
+  };
+  run("engine", m, 0);
+  run("perfect", *frozen, build);
+}
+
+// loading N random keys into an empty table: one put each against
+// bulk_load on 1, 2, 4 and one per core threads. ms for the whole load
+template <class M, class K, class G>
+void do_bench_bulk(string n, ostream &stream) {
+  const size_t keys = 10000000;
+  cerr << "BEGIN " << n << " bulk\n";
+  G keygen_;
+  vector<K> ks(keys);
+  vector<uint64_t> vs(keys);
+  for (size_t i = 0; i < keys; i++) {
+    ks[i] = keygen_.get();
+    vs[i] = i;
+  }
+  auto report = [&](const string &how, size_t threads, const M &m,
+                    uint64_t ns) {
+    stream << n << ", " << keys << ", " << how << ", " << threads << ", "
+           << ns / 1000000 << ", " << m.size() << "\n";
+  };
+  {
+    M m;
+    uint64_t ns;
+    {
+      Clock c([&ns](uint64_t x) { ns = x; });
+      for (size_t i = 0; i < keys; i++) {
+        m.put(ks[i], vs[i]);
+      }
+    }
+    report("put", 1, m, ns);
+  }
+  size_t cores = max(1u, thread::hardware_concurrency());
+  for (size_t threads : {size_t(1), size_t(2), size_t(4), cores}) {
+    M m;
+    uint64_t ns;
+    {
+      Clock c([&ns](uint64_t x) { ns = x; });
+      m.bulk_load(ks, vs, threads);
+    }
+    report("bulk_load", threads, m, ns);
+  }
+}
+
+// a restart: replaying N puts into an empty table against opening the
+// snapshot of it, then ns per get over the first 1M random gets on each.
+// the mapped table's gets include its page faults. the file is still in the
+// page cache, so this is the best case for the disk
+template <class M, class K, class Make>
+void do_bench_startup(string n, ostream &stream) {
+  const uint64_t keys = 10000000;
+  const int num_bench = 1000000;
+  const string path = "crash_snapshot.bin";
+  cerr << "BEGIN " << n << " startup\n";
+  Make make;
+  pcg32 rng(config.seed, 1);
+  auto gets = [&](const M &m) {
+    uint64_t ns;
+    {
+      Clock c([&ns](uint64_t x) { ns = x; });
+      for (int i = 0; i < num_bench; i++) {
+        auto x = m.get(make(rng.get() % keys));
+        doNotOptimizeAway(*x);
+      }
+    }
+    return double(ns) / num_bench;
+  };
+  uint64_t rebuild, save, open;
+  double rebuilt_gets, mapped_gets;
+  {
+    M m;
+    {
+      Clock c([&rebuild](uint64_t ns) { rebuild = ns; });
+      for (uint64_t i = 0; i < keys; i++) {
+        m.put(make(i), i);
+      }
+    }
+    rebuilt_gets = gets(m);
+    Clock c([&save](uint64_t ns) { save = ns; });
+    m.save(path.c_str());
+  }
+  {
+    optional<M> m;
+    {
+      Clock c([&open](uint64_t ns) { open = ns; });
+      m.emplace(M::open_mapped(path.c_str()));
+    }
+    mapped_gets = gets(*m);
+  }
+  remove(path.c_str());
+  stream << n << ", " << keys << ", " << rebuild / 1000000 << ", "
+         << save / 1000000 << ", " << open / 1000 << ", "
+         << rebuilt_gets << ", " << mapped_gets << "\n";
+}
+
+// `ops` calls of op(i), each timed on its own. closed loop by default: an
+// op starts when the one before it is done, so a stall is only ever counted
+// once, by the op that hit it. with --rate ops are due on a fixed schedule
+// instead and each one's latency runs from when it was due, so every op
+// that queued up behind a stall counts its wait too, like the requests of a
+// real server would (coordinated omission)
+template <class Op> Latency_Histogram time_ops(size_t ops, Op &&op) {
+  const Tsc_Clock &tsc = Tsc_Clock::get();
+  Latency_Histogram hist;
+  if (config.rate <= 0) {
+    for (size_t i = 0; i < ops; i++) {
+      uint64_t start = tsc.start();
+      op(i);
+      hist.add(tsc.ns(tsc.stop() - start));
+    }
+    return hist;
+  }
+  double interval = tsc.ticks(1e9 / config.rate);
+  uint64_t first = tsc.start();
+  for (size_t i = 0; i < ops; i++) {
+    uint64_t due = first + uint64_t(i * interval);
+    while (tsc.start() < due) {
+    }
+    op(i);
+    hist.add(tsc.ns(tsc.stop() - due));
+  }
+  return hist;
+}
+
+// the tail of every kind of op: N puts into an empty table (its resizes
+// land in there), N random gets that hit, N random gets that miss, then N/2
+// erases. ns, one row per op
+template <class M, class K, class G>
+void do_bench_latency(string n, ostream &stream) {
+  vector<size_t> sizes = config.sizes;
+  if (sizes.empty())
+    sizes = {1 << 20};
+  for (size_t N : sizes) {
+    cerr << "BEGIN " << n << " latency, " << N << " keys\n";
+    G keygen_;
+    unordered_set<K, decltype([](const auto &z) { return z.hash(); })> ks;
+    while (ks.size() != 2 * N) {
+      ks.insert(keygen_.get());
+    }
+    vector<K> keys(ks.begin(), ks.end());
+    ks.clear();
+    pcg32 rng(config.seed, 1);
+    vector<uint32_t> order(N);
+    for (auto &o : order) {
+      o = rng.get() % N;
+    }
+
+    auto report = [&](const string &op, const Latency_Histogram &h) {
+      stream << n << ", " << N << ", " << op << ", " << config.rate << ", "
+             << h.size() << ", " << h.quantile(0.5) << ", "
+             << h.quantile(0.99) << ", " << h.quantile(0.999) << ", "
+             << h.quantile(0.9999) << ", " << h.max_ns() << "\n";
+    };
+    M m;
+    report("put", time_ops(N, [&](size_t i) { m.put(keys[i], i); }));
+    report("get_hit", time_ops(N, [&](size_t i) {
+             auto x = m.get(keys[order[i]]);
+             doNotOptimizeAway(*x);
+           }));
+    report("get_miss", time_ops(N, [&](size_t i) {
+             auto x = m.get(keys[N + order[i]]);
+             doNotOptimizeAway(x.has_value());
+           }));
+    report("erase", time_ops(N / 2, [&](size_t i) { m.erase(keys[i]); }));
+  }
+}
+
+void usage(const char *argv0) {
+  cerr << "usage: " << argv0 << " [options]\n"
+       << R"(
+  --suite LIST    main, hash, churn, shrink, small, perfect, startup,
+                  latency, bulk, concurrent, reclaim, numa. all of them
+                  by default
+  --engine LIST   first word of the row name, e.g. linear,robinhood,swiss
+  --key LIST      whole words of the row name, e.g. int,"int std",faststring
+  --lf LIST       load factors, e.g. 50,70
+  --filter REGEX  searched for in the row name
+  --sizes LIST    keys per main suite row instead of its own, and for the
+                  latency suite instead of 1m. k and m are 2^10 and 2^20.
+                  "sweep" is 1k,16k,128k,1m,16m, L1 to DRAM for int keys
+  --warmup N      main suite runs thrown away first (1)
+  --reps N        main suite runs summed up as median, p5 and p95 (5)
+  --seed N        for the gets, erases and batches picked at random (42)
+  --cpu N         pin to cpu N, the multi threaded suites aren't
+  --perf          instructions, cycles, cache and branch misses per op
+  --rate N        latency suite ops per second, on a fixed schedule. 0,
+                  the default, starts each op when the last one is done
+  --threads LIST  concurrent and numa suite thread counts (1, 2, 4 ..
+                  cores), and reclaim suite ones (1, 2, 4 .. 64)
+  --mix LIST      concurrent suite gets/puts/erases in percent
+                  (95/5/0,80/15/5,50/25/25)
+  --zipf LIST     concurrent suite zipf thetas below 1, run next to uniform
+                  keys. "none" for only uniform (0.99)
+  --duration MS   per concurrent, reclaim and numa run (1000)
+  --csv PATH      main suite results (out.csv)
+  --json PATH     main suite results with every sample (out.json)
+  --list          print the main suite rows the filters pick and exit
+
+the filters apply to every suite but hash. --warmup and --reps only to
+the main one
+)";
+}
+
+vector<string> split(const string &s) {
+  vector<string> out;
+  size_t start = 0;
+  for (size_t comma; (comma = s.find(',', start)) != string::npos;
+       start = comma + 1) {
+    out.push_back(s.substr(start, comma - start));
+  }
+  out.push_back(s.substr(start));
+  return out;
+}
+
+size_t parse_count(const string &s) {
+  size_t end;
+  size_t n = stoull(s, &end);
+  string suffix = Bench_Config::lower(s.substr(end));
+  if (suffix == "k")
+    return n << 10;
+  if (suffix == "m")
+    return n << 20;
+  if (!suffix.empty())
+    throw invalid_argument("bad count " + s);
+  return n;
+}
+
+// fills in config, false for --list
+bool parse_args(int argc, char **argv) {
+  bool run = true;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    auto value = [&]() -> string {
+      if (i + 1 == argc)
+        throw invalid_argument(arg + " needs a value");
+      return argv[++i];
+    };
+    if (arg == "--suite") {
+      for (const auto &x : split(value()))
+        config.suites.insert(x);
+    } else if (arg == "--engine") {
+      config.engines = split(value());
+    } else if (arg == "--key") {
+      config.keys = split(value());
+    } else if (arg == "--lf") {
+      config.load_factors = split(value());
+    } else if (arg == "--filter") {
+      config.filter = regex(value());
+    } else if (arg == "--sizes") {
+      string v = value();
+      if (v == "sweep")
+        v = "1k,16k,128k,1m,16m";
+      config.sizes.clear();
+      for (const auto &x : split(v))
+        config.sizes.push_back(parse_count(x));
+    } else if (arg == "--warmup") {
+      config.warmup = parse_count(value());
+    } else if (arg == "--reps") {
+      config.reps = max<size_t>(1, parse_count(value()));
+    } else if (arg == "--seed") {
+      config.seed = stoull(value());
+    } else if (arg == "--cpu") {
+      config.cpu = stoi(value());
+    } else if (arg == "--perf") {
+      config.perf = true;
+    } else if (arg == "--rate") {
+      config.rate = stod(value());
+    } else if (arg == "--threads") {
+      config.threads.clear();
+      for (const auto &x : split(value()))
+        config.threads.push_back(max<size_t>(1, parse_count(x)));
+    } else if (arg == "--mix") {
+      config.mixes.clear();
+      for (const auto &x : split(value()))
+        config.mixes.push_back(Op_Mix::parse(x));
+    } else if (arg == "--zipf") {
+      config.zipf.clear();
+      string v = value();
+      for (const auto &x : split(v)) {
+        if (v == "none")
+          break;
+        double theta = stod(x);
+        if (theta <= 0 || theta >= 1)
+          throw invalid_argument("zipf theta " + x + " isn't in (0, 1)");
+        config.zipf.push_back(theta);
+      }
+    } else if (arg == "--duration") {
+      config.duration = parse_count(value());
+    } else if (arg == "--csv") {
+      config.csv = value();
+    } else if (arg == "--json") {
+      config.json = value();
+    } else if (arg == "--list") {
+      run = false;
+    } else {
+      throw invalid_argument("unknown option " + arg);
+    }
+  }
+  return run;
+}
+
+int main(int argc, char **argv) {
+  bool run;
+  try {
+    run = parse_args(argc, argv);
+  } catch (const exception &e) {
+    cerr << e.what() << "\n";
+    usage(argv[0]);
+    return 2;
+  }
   const int string_inserts = 10000000;
   const int int_inserts = 10000000;
-  map<string, function<void(string, ostream &)>> benchmarks = {
+  // 8-200 bytes each, and every key is generated twice over
+  const int string_key_inserts = 2000000;
+  const int strided_inserts = 1000000;
+  // the main suite, each row with its own default key count
+  struct row {
+    size_t keys;
+    void (*run)(const string &, size_t, Bench_Report &);
+  };
+  map<string, row> benchmarks = {
       // unordered_map
       {"Std Unordered String",
-       do_bench<Std_Unordered<String, uint64_t>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
+       {string_inserts,
+        do_bench<Std_Unordered<String, uint64_t>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
+      {"Std Unordered StringKey",
+       {string_key_inserts,
+        do_bench<Std_Unordered<StringKey, uint64_t>, StringKey, uint64_t,
+                 gen_string_key, gen_int_unwrap>}},
       {"Std Unordered Int Std",
-       do_bench<Std_Unordered<i64_std, uint64_t>, i64_std, uint64_t,
-                gen_int_std, gen_int_unwrap, int_inserts>},
+       {int_inserts,
+        do_bench<Std_Unordered<i64_std, uint64_t>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
 
       // quadratic
       {"Quadratic 50 String",
-       do_bench<quadratic<String, uint64_t, 50>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
+       {string_inserts,
+        do_bench<quadratic<String, uint64_t, 50>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
       {"Quadratic 50 Int Std",
-       do_bench<quadratic<i64_std, uint64_t, 50>, i64_std, uint64_t,
-                gen_int_std, gen_int_unwrap, int_inserts>},
+       {int_inserts,
+        do_bench<quadratic<i64_std, uint64_t, 50>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
       {"Quadratic 70 String",
-       do_bench<quadratic<String, uint64_t, 70>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
+       {string_inserts,
+        do_bench<quadratic<String, uint64_t, 70>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
       {"Quadratic 70 Int Std",
-       do_bench<quadratic<i64_std, uint64_t, 70>, i64_std, uint64_t,
-                gen_int_std, gen_int_unwrap, int_inserts>},
+       {int_inserts,
+        do_bench<quadratic<i64_std, uint64_t, 70>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
       {"Quadratic 90 String",
-       do_bench<quadratic<String, uint64_t, 90>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
+       {string_inserts,
+        do_bench<quadratic<String, uint64_t, 90>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
       {"Quadratic 90 Int Std",
-       do_bench<quadratic<i64_std, uint64_t, 90>, i64_std, uint64_t,
-                gen_int_std, gen_int_unwrap, int_inserts>},
+       {int_inserts,
+        do_bench<quadratic<i64_std, uint64_t, 90>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
 
       // linear
       {"Linear 50 String",
-       do_bench<linear<String, uint64_t, 50>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 50>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
       {"Linear 50 Int Std",
-       do_bench<linear<i64_std, uint64_t, 50>, i64_std, uint64_t, gen_int_std,
-                gen_int_unwrap, int_inserts>},
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 50>, i64_std, uint64_t, gen_int_std,
+                 gen_int_unwrap>}},
       {"Linear 70 String",
-       do_bench<linear<String, uint64_t, 70>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 70>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
       {"Linear 70 Int Std",
-       do_bench<linear<i64_std, uint64_t, 70>, i64_std, uint64_t, gen_int_std,
-                gen_int_unwrap, int_inserts>},
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 70>, i64_std, uint64_t, gen_int_std,
+                 gen_int_unwrap>}},
+      // same scheme, identity hash vs squirrel3 on keys with constant low bits
+      {"Linear 70 Int Std Strided",
+       {strided_inserts,
+        do_bench<linear<i64_std, uint64_t, 70>, i64_std, uint64_t,
+                 gen_strided<i64_std>, gen_int_unwrap>}},
+      {"Linear 70 Int Strided",
+       {strided_inserts,
+        do_bench<linear<i64, uint64_t, 70>, i64, uint64_t, gen_strided<i64>,
+                 gen_int_unwrap>}},
       {"Linear 90 String",
-       do_bench<linear<String, uint64_t, 90>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 90>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
       {"Linear 90 Int Std",
-       do_bench<linear<i64_std, uint64_t, 90>, i64_std, uint64_t, gen_int_std,
-                gen_int_unwrap, int_inserts>},
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 90>, i64_std, uint64_t, gen_int_std,
+                 gen_int_unwrap>}},
 
       // robinhood
       {"Robinhood 50 Int Std",
-       do_bench<robinhood<i64_std, uint64_t, 50>, i64_std, uint64_t,
-                gen_int_std, gen_int_unwrap, int_inserts>},
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 50>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
       {"Robinhood 50 String",
-       do_bench<robinhood<String, uint64_t, 50>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
-      {"Ronibhood 70 Int Std",
-       do_bench<robinhood<i64_std, uint64_t, 70>, i64_std, uint64_t,
-                gen_int_std, gen_int_unwrap, int_inserts>},
+       {string_inserts,
+        do_bench<robinhood<String, uint64_t, 50>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
+      {"Robinhood 70 Int Std",
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 70>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
       {"Robinhood 70 String",
-       do_bench<robinhood<String, uint64_t, 70>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
+       {string_inserts,
+        do_bench<robinhood<String, uint64_t, 70>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
       {"Robinhood 90 Int Std",
-       do_bench<robinhood<i64_std, uint64_t, 90>, i64_std, uint64_t,
-                gen_int_std, gen_int_unwrap, int_inserts>},
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 90>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
       {"Robinhood 90 String",
-       do_bench<robinhood<String, uint64_t, 90>, String, uint64_t, gen_string,
-                gen_int_unwrap, string_inserts>},
+       {string_inserts,
+        do_bench<robinhood<String, uint64_t, 90>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
+
+      // metadata layouts, the rows above use soa<packed_meta>
+      {"Linear 70 String Byte Meta",
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 70, soa<byte_meta>>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Linear 70 Int Std Byte Meta",
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 70, soa<byte_meta>>, i64_std,
+                 uint64_t, gen_int_std, gen_int_unwrap>}},
+      {"Linear 70 String Interleaved",
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 70, interleaved>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Linear 70 Int Std Interleaved",
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 70, interleaved>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Quadratic 70 Int Std Byte Meta",
+       {int_inserts,
+        do_bench<quadratic<i64_std, uint64_t, 70, soa<byte_meta>>, i64_std,
+                 uint64_t, gen_int_std, gen_int_unwrap>}},
+      {"Quadratic 70 Int Std Interleaved",
+       {int_inserts,
+        do_bench<quadratic<i64_std, uint64_t, 70, interleaved>, i64_std,
+                 uint64_t, gen_int_std, gen_int_unwrap>}},
+      {"Robinhood 70 Int Std Byte Meta",
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 70, soa<byte_meta>>, i64_std,
+                 uint64_t, gen_int_std, gen_int_unwrap>}},
+      {"Robinhood 70 Int Std Interleaved",
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 70, interleaved>, i64_std,
+                 uint64_t, gen_int_std, gen_int_unwrap>}},
+
+      // key, value and state in one bucket
+      {"Linear 50 String AoS",
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 50, aos>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Linear 50 Int Std AoS",
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 50, aos>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Quadratic 50 String AoS",
+       {string_inserts,
+        do_bench<quadratic<String, uint64_t, 50, aos>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Quadratic 50 Int Std AoS",
+       {int_inserts,
+        do_bench<quadratic<i64_std, uint64_t, 50, aos>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Robinhood 50 String AoS",
+       {string_inserts,
+        do_bench<robinhood<String, uint64_t, 50, aos>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Robinhood 50 Int Std AoS",
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 50, aos>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Linear 70 String AoS",
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 70, aos>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Linear 70 Int Std AoS",
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 70, aos>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Quadratic 70 String AoS",
+       {string_inserts,
+        do_bench<quadratic<String, uint64_t, 70, aos>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Quadratic 70 Int Std AoS",
+       {int_inserts,
+        do_bench<quadratic<i64_std, uint64_t, 70, aos>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Robinhood 70 String AoS",
+       {string_inserts,
+        do_bench<robinhood<String, uint64_t, 70, aos>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Robinhood 70 Int Std AoS",
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 70, aos>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Linear 90 String AoS",
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 90, aos>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Linear 90 Int Std AoS",
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 90, aos>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Quadratic 90 String AoS",
+       {string_inserts,
+        do_bench<quadratic<String, uint64_t, 90, aos>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Quadratic 90 Int Std AoS",
+       {int_inserts,
+        do_bench<quadratic<i64_std, uint64_t, 90, aos>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Robinhood 90 String AoS",
+       {string_inserts,
+        do_bench<robinhood<String, uint64_t, 90, aos>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Robinhood 90 Int Std AoS",
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 90, aos>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+
+      // resize spread over the puts after it
+      {"Linear 70 String Incremental",
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 70, soa<>, true>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Linear 70 Int Std Incremental",
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 70, soa<>, true>, i64_std, uint64_t,
+                 gen_int_std, gen_int_unwrap>}},
+      {"Quadratic 70 String Incremental",
+       {string_inserts,
+        do_bench<quadratic<String, uint64_t, 70, soa<>, true>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Quadratic 70 Int Std Incremental",
+       {int_inserts,
+        do_bench<quadratic<i64_std, uint64_t, 70, soa<>, true>, i64_std,
+                 uint64_t, gen_int_std, gen_int_unwrap>}},
+      {"Robinhood 70 String Incremental",
+       {string_inserts,
+        do_bench<robinhood<String, uint64_t, 70, soa<>, true>, String, uint64_t,
+                 gen_string, gen_int_unwrap>}},
+      {"Robinhood 70 Int Std Incremental",
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 70, soa<>, true>, i64_std,
+                 uint64_t, gen_int_std, gen_int_unwrap>}},
+
+      // plain std::allocator, no slab reuse and no huge pages
+      {"Linear 70 Int Std Std Alloc",
+       {int_inserts,
+        do_bench<linear<i64_std, uint64_t, 70, soa<>, false,
+                        std::allocator<i64_std>>,
+                 i64_std, uint64_t, gen_int_std, gen_int_unwrap>}},
+      {"Robinhood 70 Int Std Std Alloc",
+       {int_inserts,
+        do_bench<robinhood<i64_std, uint64_t, 70, soa<>, false,
+                           std::allocator<i64_std>>,
+                 i64_std, uint64_t, gen_int_std, gen_int_unwrap>}},
+      {"Swiss 90 Int Std Std Alloc",
+       {int_inserts,
+        do_bench<swiss<i64_std, uint64_t, 90, std::allocator<i64_std>>, i64_std,
+                 uint64_t, gen_int_std, gen_int_unwrap>}},
+      {"Linear 70 String Std Alloc",
+       {string_inserts,
+        do_bench<linear<String, uint64_t, 70, soa<>, false,
+                        std::allocator<String>>,
+                 String, uint64_t, gen_string, gen_int_unwrap>}},
+
+      // String with wyhash instead of djb2
+      {"Linear 70 FastString",
+       {string_inserts,
+        do_bench<linear<FastString, uint64_t, 70>, FastString, uint64_t,
+                 gen_fast_string, gen_int_unwrap>}},
+      {"Quadratic 70 FastString",
+       {string_inserts,
+        do_bench<quadratic<FastString, uint64_t, 70>, FastString, uint64_t,
+                 gen_fast_string, gen_int_unwrap>}},
+      {"Robinhood 70 FastString",
+       {string_inserts,
+        do_bench<robinhood<FastString, uint64_t, 70>, FastString, uint64_t,
+                 gen_fast_string, gen_int_unwrap>}},
+      {"Swiss 90 FastString",
+       {string_inserts,
+        do_bench<swiss<FastString, uint64_t, 90>, FastString, uint64_t,
+                 gen_fast_string, gen_int_unwrap>}},
+
+      // variable length keys
+      {"Linear 70 StringKey",
+       {string_key_inserts,
+        do_bench<linear<StringKey, uint64_t, 70>, StringKey, uint64_t,
+                 gen_string_key, gen_int_unwrap>}},
+      {"Quadratic 70 StringKey",
+       {string_key_inserts,
+        do_bench<quadratic<StringKey, uint64_t, 70>, StringKey, uint64_t,
+                 gen_string_key, gen_int_unwrap>}},
+      {"Robinhood 70 StringKey",
+       {string_key_inserts,
+        do_bench<robinhood<StringKey, uint64_t, 70>, StringKey, uint64_t,
+                 gen_string_key, gen_int_unwrap>}},
+      {"Swiss 90 StringKey",
+       {string_key_inserts,
+        do_bench<swiss<StringKey, uint64_t, 90>, StringKey, uint64_t,
+                 gen_string_key, gen_int_unwrap>}},
+
+      // swiss
+      {"Swiss 50 String",
+       {string_inserts,
+        do_bench<swiss<String, uint64_t, 50>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
+      {"Swiss 50 Int Std",
+       {int_inserts,
+        do_bench<swiss<i64_std, uint64_t, 50>, i64_std, uint64_t, gen_int_std,
+                 gen_int_unwrap>}},
+      {"Swiss 70 String",
+       {string_inserts,
+        do_bench<swiss<String, uint64_t, 70>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
+      {"Swiss 70 Int Std",
+       {int_inserts,
+        do_bench<swiss<i64_std, uint64_t, 70>, i64_std, uint64_t, gen_int_std,
+                 gen_int_unwrap>}},
+      {"Swiss 90 String",
+       {string_inserts,
+        do_bench<swiss<String, uint64_t, 90>, String, uint64_t, gen_string,
+                 gen_int_unwrap>}},
+      {"Swiss 90 Int Std",
+       {int_inserts,
+        do_bench<swiss<i64_std, uint64_t, 90>, i64_std, uint64_t, gen_int_std,
+                 gen_int_unwrap>}},
 
   };
 
-  freopen("out.csv", "w", stdout);
-  cout << "name";
-  for (const auto &[n, _] : bench<Std_Unordered<String, uint64_t>, String,
-                                  uint64_t, gen_string, gen_int_unwrap, 1>()) {
+  if (!run) {
+    for (const auto &[n, r] : benchmarks) {
+      if (config.selects(n))
+        cout << n << ", " << r.keys << " keys\n";
+    }
+    return 0;
+  }
 
-    cout << ", " << n;
+#if defined(__linux__)
+  cpu_set_t all_cpus;
+  sched_getaffinity(0, sizeof(all_cpus), &all_cpus);
+  if (config.cpu >= 0) {
+    cpu_set_t one;
+    CPU_ZERO(&one);
+    CPU_SET(config.cpu, &one);
+    if (sched_setaffinity(0, sizeof(one), &one) != 0)
+      cerr << "can't pin to cpu " << config.cpu << ": " << strerror(errno)
+           << "\n";
+  }
+#endif
+  if (config.perf) {
+    if (string error = perf.open(); !error.empty())
+      cerr << "no perf counters, going on without (" << error << ")\n";
   }
-  cout << "\n";
 
-  gen_int_std x;
-  for (int i = 0; i < 50; i++) {
-    auto z = x.get();
-    cerr << "bruh: " << z.i << " " << z.hash() << "\n";
+  if (config.wants("main")) {
+    Bench_Report report(config.csv);
+    for (const auto &[n, r] : benchmarks) {
+      if (!config.selects(n))
+        continue;
+      if (config.sizes.empty())
+        r.run(n, r.keys, report);
+      for (size_t keys : config.sizes) {
+        r.run(n, keys, report);
+      }
+    }
+    report.write_json(config.json);
   }
 
-  for (const auto &[n, fn] : benchmarks) {
-    fn(n, cout);
+  // every other suite writes its own out_<suite>.csv
+  using suite = map<string, function<void(string, ostream &)>>;
+  auto run_suite = [](const string &name, const string &header,
+                      const suite &rows) {
+    if (!config.wants(name))
+      return;
+    ofstream out("out_" + name + ".csv");
+    out << header;
+    for (const auto &[n, fn] : rows) {
+      if (config.selects(n))
+        fn(n, out);
+    }
+  };
+
+  if (config.wants("hash")) {
+    ofstream hash_out("out_hash.csv");
+    hash_out << "name, scheme, ns per hash, avg probe, max probe\n";
+    do_hash_quality<String, gen_string>("djb2", hash_out);
+    do_hash_quality<FastString, gen_fast_string>("wyhash", hash_out);
   }
+
+  run_suite(
+      "churn",
+      "name, round, ns per cycle, p99 ns, max ns, size, memuse, "
+      "tombstone ratio\n",
+      {
+          {"Std Unordered Int",
+           do_bench_churn<Std_Unordered<i64, uint64_t>, i64, make_int>},
+          {"Linear 70 Int",
+           do_bench_churn<linear<i64, uint64_t, 70>, i64, make_int>},
+          {"Quadratic 70 Int",
+           do_bench_churn<quadratic<i64, uint64_t, 70>, i64, make_int>},
+          {"Quadratic 70 Int Incremental",
+           do_bench_churn<quadratic<i64, uint64_t, 70, soa<>, true>, i64,
+                          make_int>},
+          {"Robinhood 70 Int",
+           do_bench_churn<robinhood<i64, uint64_t, 70>, i64, make_int>},
+          {"Linear 70 FastString",
+           do_bench_churn<linear<FastString, uint64_t, 70>, FastString,
+                          make_fast_string>},
+          {"Quadratic 70 FastString",
+           do_bench_churn<quadratic<FastString, uint64_t, 70>, FastString,
+                          make_fast_string>},
+      });
+
+  run_suite(
+      "shrink", "name, phase, size, memuse, rss MB\n",
+      {
+          {"Linear 70 Int",
+           do_bench_shrink<linear<i64, uint64_t, 70>, i64, make_int>},
+          {"Quadratic 70 Int",
+           do_bench_shrink<quadratic<i64, uint64_t, 70>, i64, make_int>},
+          {"Robinhood 70 Int",
+           do_bench_shrink<robinhood<i64, uint64_t, 70>, i64, make_int>},
+          {"Swiss 90 Int",
+           do_bench_shrink<swiss<i64, uint64_t, 90>, i64, make_int>},
+      });
+
+  if (config.wants("small")) {
+    ofstream small_out("out_small.csv");
+    small_out << "name, keys, ns per hit, ns per miss, ns per update\n";
+    do_bench_small_sizes<16>(small_out);
+    do_bench_small_sizes<64>(small_out);
+    do_bench_small_sizes<256>(small_out);
+    do_bench_small_sizes<1024>(small_out);
+    do_bench_small_sizes<4096>(small_out);
+  }
+
+  run_suite(
+      "perfect",
+      "name, table, keys, build ms, memuse, ns per present get, "
+      "ns per missing get\n",
+      {
+          {"Linear 70 Int",
+           do_bench_frozen<linear<i64, uint64_t, 70>, i64, gen_int, 10000000>},
+          {"Robinhood 70 Int",
+           do_bench_frozen<robinhood<i64, uint64_t, 70>, i64, gen_int,
+                           10000000>},
+          {"Linear 70 Int Small",
+           do_bench_frozen<linear<i64, uint64_t, 70>, i64, gen_int, 100000>},
+          {"Robinhood 70 String",
+           do_bench_frozen<robinhood<String, uint64_t, 70>, String,
+                           gen_string, 1000000>},
+          {"Linear 70 FastString",
+           do_bench_frozen<linear<FastString, uint64_t, 70>, FastString,
+                           gen_fast_string, 1000000>},
+      });
+
+  run_suite(
+      "startup",
+      "name, keys, rebuild ms, save ms, open us, "
+      "ns per get after rebuild, ns per get after open\n",
+      {
+          {"Linear 70 Int",
+           do_bench_startup<linear<i64, uint64_t, 70>, i64, make_int>},
+          {"Quadratic 70 Int",
+           do_bench_startup<quadratic<i64, uint64_t, 70>, i64, make_int>},
+          {"Robinhood 70 Int",
+           do_bench_startup<robinhood<i64, uint64_t, 70>, i64, make_int>},
+          {"Linear 70 FastString",
+           do_bench_startup<linear<FastString, uint64_t, 70>, FastString,
+                            make_fast_string>},
+      });
+
+  run_suite(
+      "latency",
+      "name, keys, op, rate, ops, p50 ns, p99 ns, p99.9 ns, p99.99 ns, "
+      "max ns\n",
+      {
+          {"Std Unordered Int",
+           do_bench_latency<Std_Unordered<i64, uint64_t>, i64, gen_int>},
+          {"Linear 50 Int",
+           do_bench_latency<linear<i64, uint64_t, 50>, i64, gen_int>},
+          {"Linear 70 Int",
+           do_bench_latency<linear<i64, uint64_t, 70>, i64, gen_int>},
+          {"Linear 90 Int",
+           do_bench_latency<linear<i64, uint64_t, 90>, i64, gen_int>},
+          {"Linear 90 Int Incremental",
+           do_bench_latency<linear<i64, uint64_t, 90, soa<>, true>, i64,
+                            gen_int>},
+          {"Quadratic 70 Int",
+           do_bench_latency<quadratic<i64, uint64_t, 70>, i64, gen_int>},
+          {"Quadratic 90 Int",
+           do_bench_latency<quadratic<i64, uint64_t, 90>, i64, gen_int>},
+          {"Robinhood 70 Int",
+           do_bench_latency<robinhood<i64, uint64_t, 70>, i64, gen_int>},
+          {"Robinhood 90 Int",
+           do_bench_latency<robinhood<i64, uint64_t, 90>, i64, gen_int>},
+          {"Robinhood 90 Int Incremental",
+           do_bench_latency<robinhood<i64, uint64_t, 90, soa<>, true>, i64,
+                            gen_int>},
+          {"Swiss 90 Int",
+           do_bench_latency<swiss<i64, uint64_t, 90>, i64, gen_int>},
+      });
+
+  // the rest want every cpu
+#if defined(__linux__)
+  sched_setaffinity(0, sizeof(all_cpus), &all_cpus);
+#endif
+
+  run_suite(
+      "bulk", "name, keys, how, threads, ms, size\n",
+      {
+          {"Linear 70 Int",
+           do_bench_bulk<linear<i64, uint64_t, 70>, i64, gen_int>},
+          {"Quadratic 70 Int",
+           do_bench_bulk<quadratic<i64, uint64_t, 70>, i64, gen_int>},
+          {"Robinhood 70 Int",
+           do_bench_bulk<robinhood<i64, uint64_t, 70>, i64, gen_int>},
+          {"Robinhood 70 FastString",
+           do_bench_bulk<robinhood<FastString, uint64_t, 70>, FastString,
+                         gen_fast_string>},
+      });
+
+  run_suite(
+      "concurrent",
+      "name, mix, key dist, threads, mops, scaling, thread min mops, "
+      "thread max mops, fairness\n",
+      {
+          {"Concurrent String",
+           do_bench_mixed<concurrent_hashtable<String, uint32_t>, String,
+                          gen_string>},
+          {"Sharded Linear 70 String",
+           do_bench_mixed<sharded<linear<String, uint32_t, 70>>, String,
+                          gen_string>},
+          {"Sharded Robinhood 70 String",
+           do_bench_mixed<sharded<robinhood<String, uint32_t, 70>>, String,
+                          gen_string>},
+          {"Sharded Swiss 90 String",
+           do_bench_mixed<sharded<swiss<String, uint32_t, 90>>, String,
+                          gen_string>},
+      });
+
+  run_suite("reclaim",
+            "name, threads, guarded mops, unguarded mops, overhead %\n",
+            {
+                {"Concurrent String",
+                 do_bench_reclaim<String, uint32_t, gen_string>},
+                {"Concurrent Int", do_bench_reclaim<i64, uint64_t, gen_int>},
+            });
+
+  run_suite("numa", "name, placement, threads, mops, vs local\n",
+            {
+                {"Concurrent String",
+                 do_bench_numa<String, uint32_t, gen_string>},
+                {"Concurrent Int", do_bench_numa<i64, uint64_t, gen_int>},
+            });
 }
@@ -0,0 +1,179 @@
+#pragma once
+
+#ifndef BULK_HPP
+#define BULK_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace crash {
+
+// loading a whole key set into an empty engine at once, see bulk_load() on
+// linear, quadratic and robinhood.
+//
+// the slot array is made at its final size up front. every key is hashed
+// on `threads` threads and radix partitioned by the top bits of its home
+// slot, so partition p only holds keys whose home is in slice p of the
+// array. threads then take whole partitions, sort each by home slot and
+// fill its slice front to back: no locks, no duplicate probes, no resizes.
+// a key whose probe would run off the end of its slice is handed back to go
+// in with put() once the threads are done. the array is at most LF full,
+// so that's a handful per slice.
+//
+// slices are at least 64 slots, so no two threads ever write the same
+// packed_meta word. a key given more than once keeps its last value, like
+// a run of puts would
+
+// below this many keys it's all done on the calling thread
+constexpr size_t bulk_serial_below = 1 << 16;
+// about how many keys go in one partition
+constexpr size_t bulk_partition_keys = 1 << 12;
+
+// fills the empty `cap` slot array `slots` with keys[i], values[i] and
+// returns how many went in. the indices of the ones that didn't are added
+// to `spill`. place(slots, home, next, end) is where a key with that home
+// goes: the first slot of its probe that's free, or `end` if the probe
+// leaves the slice first. `next` is the slot after the last one filled in
+// the slice, everything from the slice start up to it is decided
+template <class Storage, class K, class V, class Place>
+size_t bulk_fill(Storage &slots, size_t cap, std::span<const K> keys,
+                 std::span<const V> values, size_t threads,
+                 std::vector<size_t> &spill, Place &&place) {
+  size_t n = keys.size(), mask = cap - 1;
+  if (!threads)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  if (n < bulk_serial_below)
+    threads = 1;
+  // a few partitions per thread, so uneven ones even out, and small enough
+  // that each one sorts in cache
+  size_t parts = std::min(std::max(std::bit_ceil(threads * 8),
+                                   std::bit_ceil(n / bulk_partition_keys)),
+                          std::max(cap / 64, size_t(1)));
+  size_t shift = std::countr_zero(cap / parts);
+
+  // f(t) for every t below threads, 0 on the calling thread
+  auto run = [threads](auto &&f) {
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++) {
+      pool.emplace_back(f, t);
+    }
+    f(0);
+    for (auto &th : pool) {
+      th.join();
+    }
+  };
+  auto first = [n, threads](size_t t) { return n * t / threads; };
+
+  // how many of each thread's keys land in each partition, then where
+  // they go: at[t * parts + p] is thread t's next spot for partition p
+  std::vector<size_t> at(threads * parts, 0);
+  run([&](size_t t) {
+    for (size_t i = first(t); i < first(t + 1); i++) {
+      at[t * parts + ((keys[i].hash() & mask) >> shift)]++;
+    }
+  });
+  std::vector<size_t> start(parts + 1, 0);
+  for (size_t p = 0, sum = 0; p < parts; p++) {
+    start[p] = sum;
+    for (size_t t = 0; t < threads; t++) {
+      sum += std::exchange(at[t * parts + p], sum);
+    }
+    start[p + 1] = sum;
+  }
+
+  // the key and value come along, so filling a slice reads them in order
+  struct entry {
+    size_t hash;
+    size_t index;
+    K key;
+    V value;
+  };
+  std::unique_ptr<entry[]> by_part(new entry[n]);
+  run([&](size_t t) {
+    for (size_t i = first(t); i < first(t + 1); i++) {
+      size_t h = keys[i].hash();
+      by_part[at[t * parts + ((h & mask) >> shift)]++] = {h, i, keys[i],
+                                                          values[i]};
+    }
+  });
+
+  std::atomic<size_t> next_part = 0;
+  std::vector<std::vector<size_t>> spills(threads);
+  std::vector<size_t> placed(threads, 0);
+  size_t slice = size_t(1) << shift;
+  run([&](size_t t) {
+    // a partition's keys are in the order they were given, a counting sort
+    // by home slot keeps them that way
+    std::vector<size_t> count(slice + 1);
+    std::vector<entry> by_home;
+    for (size_t p; (p = next_part.fetch_add(1)) < parts;) {
+      size_t base = p << shift, end = base + slice;
+      std::span<entry> part(&by_part[start[p]], start[p + 1] - start[p]);
+      std::fill(count.begin(), count.end(), 0);
+      for (const entry &x : part) {
+        count[(x.hash & mask) - base + 1]++;
+      }
+      for (size_t i = 0; i < slice; i++) {
+        count[i + 1] += count[i];
+      }
+      by_home.resize(part.size());
+      for (const entry &x : part) {
+        by_home[count[(x.hash & mask) - base]++] = x;
+      }
+
+      size_t next = base;
+      for (size_t i = 0; i < by_home.size(); i++) {
+        const entry &x = by_home[i];
+        size_t home = x.hash & mask;
+        // a later key with the same home might be this one again
+        bool later = false;
+        for (size_t j = i + 1;
+             j < by_home.size() && (by_home[j].hash & mask) == home && !later;
+             j++) {
+          later = by_home[j].hash == x.hash && by_home[j].key == x.key;
+        }
+        if (later)
+          continue;
+        size_t h = place(slots, home, next, end);
+        if (h >= end) {
+          spills[t].push_back(x.index);
+          continue;
+        }
+        slots.key(h) = x.key;
+        slots.value(h) = x.value;
+        slots.set_occupied(h);
+        next = std::max(next, h + 1);
+        placed[t]++;
+      }
+    }
+  });
+
+  size_t total = 0;
+  for (size_t t = 0; t < threads; t++) {
+    total += placed[t];
+    spill.insert(spill.end(), spills[t].begin(), spills[t].end());
+  }
+  return total;
+}
+
+// bulk_load from an iterator range of pairs, for inputs that aren't two
+// arrays already
+template <class Engine, class It>
+void bulk_load(Engine &t, It first, It last, size_t threads = 0) {
+  std::vector<typename Engine::K> keys;
+  std::vector<typename Engine::V> values;
+  for (; first != last; ++first) {
+    keys.push_back(first->first);
+    values.push_back(first->second);
+  }
+  t.bulk_load(keys, values, threads);
+}
+
+} // namespace crash
+
+#endif
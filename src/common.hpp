@@ -4,11 +4,19 @@
 #ifndef COMMON_HPP
 #define COMMON_HPP
 
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
 #include <cstring>
 #include <functional>
+#include <ostream>
 #include <random>
 #include <string>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 namespace crash {
 template <class Key>
@@ -40,6 +48,13 @@ public:
   uint32_t get() { return pcg32_random_r(&state); }
   pcg32_random_t state;
 };
+// something a table of K can be searched with without building a K
+template <class Q, class K>
+concept Lookup = requires(const K &k, const Q &q) {
+  { K::hash_of(q) } -> std::convertible_to<std::size_t>;
+  { k == q } -> std::convertible_to<bool>;
+};
+
 template <class K, class Hash>
 concept HashFn = requires(const K &k) {
   { Hash{}(k) } -> std::convertible_to<std::size_t>;
@@ -58,31 +73,163 @@ public:
   }
 };
 
+#if defined(__x86_64__)
+// whether an aligned 16 byte SSE load is atomic. intel and amd both promise
+// it on every cpu with AVX
+inline const bool sse_load_is_atomic = [] {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx");
+}();
+
+// a 16 byte T swapped with cmpxchg16b. std::atomic<T> sends these through
+// libatomic, which doesn't count as lock free and loads with a cmpxchg16b,
+// a write that takes the line away from every other reader. here loads are
+// plain SSE reads wherever that's atomic. every write is a full barrier, so
+// the memory orders are only there to match std::atomic
+template <class T> class wide_atomic {
+  static_assert(sizeof(T) == 16 && std::is_trivially_copyable_v<T>);
+  using word = unsigned __int128;
+
+public:
+  static constexpr bool is_always_lock_free = true;
+
+  wide_atomic() = default;
+  wide_atomic(T desired) { std::memcpy(&v, &desired, sizeof(T)); }
+  wide_atomic(const wide_atomic &other) : wide_atomic(other.load()) {}
+  wide_atomic &operator=(const wide_atomic &other) {
+    store(other.load());
+    return *this;
+  }
+
+  T load(std::memory_order = std::memory_order_seq_cst) const {
+    word w = 0;
+#if defined(__SANITIZE_THREAD__)
+    w = __atomic_load_n(&v, __ATOMIC_SEQ_CST);
+#else
+    if (sse_load_is_atomic) {
+      __m128i x;
+      asm volatile("movdqa %1, %0" : "=x"(x) : "m"(v) : "memory");
+      std::memcpy(&w, &x, sizeof(w));
+    } else {
+      cas(w, w);
+    }
+#endif
+    T t;
+    std::memcpy(&t, &w, sizeof(T));
+    return t;
+  }
+  void store(T desired, std::memory_order = std::memory_order_seq_cst) {
+    T expected = load();
+    while (!compare_exchange_weak(expected, desired)) {
+    }
+  }
+  bool compare_exchange_strong(T &expected, T desired,
+                               std::memory_order = std::memory_order_seq_cst) {
+    word e, d;
+    std::memcpy(&e, &expected, sizeof(T));
+    std::memcpy(&d, &desired, sizeof(T));
+    if (cas(e, d))
+      return true;
+    std::memcpy(&expected, &e, sizeof(T));
+    return false;
+  }
+  bool compare_exchange_weak(T &expected, T desired,
+                             std::memory_order o = std::memory_order_seq_cst) {
+    return compare_exchange_strong(expected, desired, o);
+  }
+
+private:
+  // on failure `expected` is what was there
+  bool cas(word &expected, word desired) const {
+#if defined(__SANITIZE_THREAD__)
+    // tsan can't see into the asm, but does know the builtin
+    return __atomic_compare_exchange_n(&v, &expected, desired, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+    uint64_t lo = uint64_t(expected), hi = uint64_t(expected >> 64);
+    bool ok;
+    asm volatile("lock cmpxchg16b %1"
+                 : "=@ccz"(ok), "+m"(v), "+a"(lo), "+d"(hi)
+                 : "b"(uint64_t(desired)), "c"(uint64_t(desired >> 64))
+                 : "memory");
+    expected = word(hi) << 64 | lo;
+    return ok;
+  }
+
+  alignas(16) mutable word v;
+};
+#endif
+
+inline void prefetch_read(const void *p) { __builtin_prefetch(p, 0, 3); }
+inline void prefetch_write(const void *p) { __builtin_prefetch(p, 1, 3); }
+
+// how many keys ahead get_batch/put_batch fetch, and how many hashes they
+// compute up front
+constexpr size_t batch_lookahead = 8;
+constexpr size_t batch_window = 256;
+
+// hashes a window of the batch, then runs `op(i, hash)` on each key while the
+// home buckets of the next `batch_lookahead` keys are already in flight
+template <class Hash, class Prefetch, class Op>
+void batch_pipeline(size_t n, Hash &&hash, Prefetch &&prefetch, Op &&op) {
+  size_t hs[batch_window];
+  for (size_t base = 0; base < n; base += batch_window) {
+    size_t m = std::min(batch_window, n - base);
+    for (size_t i = 0; i < m; i++) {
+      hs[i] = hash(base + i);
+    }
+    for (size_t i = 0; i < std::min(m, batch_lookahead); i++) {
+      prefetch(hs[i]);
+    }
+    for (size_t i = 0; i < m; i++) {
+      if (i + batch_lookahead < m)
+        prefetch(hs[i + batch_lookahead]);
+      op(base + i, hs[i]);
+    }
+  }
+}
+
+// a == b for two 32 byte buffers, in one or two vector compares
+inline bool equal32(const char *a, const char *b) {
+#if defined(__AVX2__)
+  __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a));
+  __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) == -1;
+#elif defined(__SSE2__)
+  __m128i lo = _mm_cmpeq_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(a)),
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+  __m128i hi = _mm_cmpeq_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + 16)),
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + 16)));
+  return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xffff;
+#else
+  return std::memcmp(a, b, 32) == 0;
+#endif
+}
+
 template <typename hash_fn> struct string_wrapper {
   string_wrapper() { std::memset(s, 0, 32); }
+  // anything past 31 characters is cut off, use string_key for longer keys
   string_wrapper(const std::string &x) {
     std::memset(s, 0, 32);
-    for (int i = 0; i < x.length(); i++) {
-      s[i] = x[i];
-    }
-    s[x.length()] = 0;
+    std::memcpy(s, x.data(), std::min<size_t>(x.length(), 31));
   }
   string_wrapper(const char *str) {
     std::memset(s, 0, 32);
-    std::strcpy(s, str);
+    std::strncpy(s, str, 31);
   }
-  string_wrapper(const string_wrapper &w) { std::strcpy(s, w.s); }
+  // trivially copyable, so tables of them can be snapshotted
+  string_wrapper(const string_wrapper &w) = default;
+  string_wrapper &operator=(const string_wrapper &w) = default;
 
   char s[32] = {};
   int operator<=>(const string_wrapper &o) const {
-    for (int i = 0; i < 31; i++) {
-      if (o.s[i] != s[i])
-        return -1;
-    }
-    return 0;
+    return std::strncmp(s, o.s, 31);
   }
+  // everything after the terminator is zero, so all 32 bytes can be compared
   template <class T> bool operator==(const string_wrapper<T> &other) const {
-    return (*this) <=> other == 0;
+    return equal32(s, other.s);
   }
   size_t hash() const { return hash_fn{}(*this); }
 };
@@ -100,7 +247,7 @@ struct _hash {
     return hash;
   }
 };
-inline uint64_t squirrel3(uint64_t at) {
+constexpr uint64_t squirrel3(uint64_t at) {
   constexpr uint64_t BIT_NOISE1 = 0x9E3779B185EBCA87ULL;
   constexpr uint64_t BIT_NOISE2 = 0xC2B2AE3D27D4EB4FULL;
   constexpr uint64_t BIT_NOISE3 = 0x27D4EB2F165667C5ULL;
@@ -112,14 +259,20 @@ inline uint64_t squirrel3(uint64_t at) {
   at ^= (at >> 8);
   return at;
 }
+// constexpr where hash_fn is, so these can key a static_table built at
+// compile time. trivial, so arrays of them aren't zeroed unless asked to be
 template <typename hash_fn> struct uint64_t_wrapper {
-  uint64_t_wrapper() {}
-  uint64_t_wrapper(uint64_t t) : i(t) {}
-  uint64_t_wrapper(int t) : i(t) {}
+  uint64_t_wrapper() = default;
+  constexpr uint64_t_wrapper(uint64_t t) : i(t) {}
+  constexpr uint64_t_wrapper(int t) : i(t) {}
 
-  size_t hash() const { return hash_fn{}(i); }
-  uint64_t operator<=>(const uint64_t_wrapper &o) const { return o.i - i; }
-  bool operator==(const uint64_t_wrapper &o) const { return o.i == i; }
+  constexpr size_t hash() const { return hash_fn{}(i); }
+  constexpr uint64_t operator<=>(const uint64_t_wrapper &o) const {
+    return o.i - i;
+  }
+  constexpr bool operator==(const uint64_t_wrapper &o) const {
+    return o.i == i;
+  }
 
   uint64_t i;
 };
@@ -129,7 +282,7 @@ struct ihash {
   }
 };
 struct sqhash {
-  size_t operator()(const uint64_t_wrapper<sqhash> &i) const {
+  constexpr size_t operator()(const uint64_t_wrapper<sqhash> &i) const {
     return squirrel3(i.i);
   }
 };
@@ -138,7 +291,8 @@ typedef string_wrapper<_hash> String;
 typedef uint64_t_wrapper<ihash> i64_std;
 typedef uint64_t_wrapper<sqhash> i64;
 
-std::ostream &operator<<(std::ostream &os, const String &s) {
+template <class H>
+std::ostream &operator<<(std::ostream &os, const string_wrapper<H> &s) {
   os << s.s;
   return os;
 }
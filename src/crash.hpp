@@ -3,113 +3,189 @@
 #ifndef CRASH_HPP
 #define CRASH_HPP
 
+#include <algorithm>
+#include <bit>
 #include <cstring>
 #include <functional>
 #include <optional>
+#include <utility>
 #include <vector>
 
 #include <iostream>
 #include <set>
+#include <span>
 #include <string>
 
 #include "common.hpp"
+#include "layout.hpp"
+#include "stats.hpp"
 
 namespace crash {
 
-template <class Key, class Value>
+template <class Key, class Value, class Layout = soa<>,
+          class Alloc = slab_allocator<Key>>
   requires Hashable<Key>
 class hashtable {
 public:
   using K = Key;
   using V = Value;
 
-  hashtable(size_t size = 16)
-      : keys(size), values(size), metadata(2 * size, false),
-        current_size(size){};
+  hashtable(size_t size = 16) : current_size(size), slots(size){};
   ~hashtable() = default;
 
   std::optional<const std::reference_wrapper<const V>> get(const K &key) const {
     // use quadratic probing
-    size_t h = get_slot(key);
-    if (metadata[2 * h]) {
-      return values[h];
+    size_t len;
+    size_t h = get_slot(key, key.hash(), len);
+    if (slots.occupied(h)) {
+      counters.hit(len);
+      return slots.value(h);
     }
+    counters.miss(len);
     return {};
   }
 
-  void put(const K &key, V v) {
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { slots.prefetch(h & (current_size - 1)); },
+        [&](size_t i, size_t h) {
+          size_t len;
+          size_t slot = get_slot(ks[i], h, len);
+          if (slots.occupied(slot)) {
+            counters.hit(len);
+            out[i] = slots.value(slot);
+          } else {
+            counters.miss(len);
+            out[i] = std::nullopt;
+          }
+        });
+  }
+
+  void put(const K &key, V v) { put(key, v, key.hash()); }
+
+  void put_batch(std::span<const K> ks, std::span<const V> vs) {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { slots.prefetch(h & (current_size - 1)); },
+        [&](size_t i, size_t h) { put(ks[i], vs[i], h); });
+  }
+
+  void put(const K &key, V v, size_t hash) {
 
-    size_t h = get_slot(key);
+    size_t h = get_slot(key, hash);
 
-    if (metadata[2 * h]) {
-      values[h] = v;
+    if (slots.occupied(h)) {
+      slots.value(h) = v;
       return;
     }
 
     // insert
-    keys[h] = key;
-
-    metadata[2 * h] = true;
-    metadata[2 * h + 1] = false;
-
-    values[h] = v;
+    slots.key(h) = key;
+    slots.set_occupied(h);
+    slots.value(h) = v;
 
     num_keys++;
     effective_keys++;
 
     if (effective_keys * 2 > current_size) {
-      hashtable x(current_size * 2);
-      int p = 0;
-      for (int i = 0; i < current_size; i++) {
-        p++;
-        if (metadata[2 * i]) {
-          x.put(keys[i], values[i]);
-        }
-      }
-      *this = std::move(x);
+      rehash(current_size * 2);
+    }
+  }
+
+  // room for n keys before the next resize
+  void reserve(size_t n) { rehash(2 * n + 1); }
+
+  // rebuild with at least n slots, or as many as the current keys need
+  void rehash(size_t n) {
+    [[maybe_unused]] auto timer = counters.time_resize();
+    counters.resized();
+    n = std::bit_ceil(std::max({n, 2 * num_keys + 1, size_t(16)}));
+    auto prev = std::exchange(slots, decltype(slots)(n));
+    size_t prev_size = std::exchange(current_size, n);
+    effective_keys = 0;
+    for (size_t i = prev.next_occupied(0); i < prev_size;
+         i = prev.next_occupied(i + 1)) {
+      insert_unique(std::move(prev.key(i)), std::move(prev.value(i)));
     }
   }
 
+  // rebuild at the smallest capacity the keys fit in, and hand what that
+  // frees back to the system
+  void shrink_to_fit() {
+    rehash(0);
+    release_cached<Alloc>();
+  }
+
   bool erase(const K &key) {
-    size_t h = get_slot(key);
-    if (metadata[2 * h]) {
+    size_t h = get_slot(key, key.hash());
+    if (slots.occupied(h)) {
       num_keys--;
-      metadata[2 * h] = false;
-      metadata[2 * h + 1] = true;
+      slots.set_tombstone(h);
 
       return true;
     }
     return false;
   }
+  void prefetch(const K &key) const {
+    slots.prefetch(key.hash() & (current_size - 1));
+  }
   size_t size() const { return num_keys; }
   size_t capacity() const { return current_size; }
 
+  // see stats.hpp. displacement is in probe steps, not slots
+  table_stats stats() const {
+    table_stats s;
+    scan_slots(s, slots, current_size, [this](size_t i) {
+      size_t len;
+      get_slot(slots.key(i), slots.key(i).hash(), len);
+      return len;
+    });
+    counters.fill(s);
+    return s;
+  }
+
   void dump() const {
-    for (int i = 0; i < current_size; i++) {
-      if (metadata[2 * i]) {
-        std::cerr << i << ": " << keys[i] << " " << values[i] << "\n";
-      }
+    for (size_t i = slots.next_occupied(0); i < current_size;
+         i = slots.next_occupied(i + 1)) {
+      std::cerr << i << ": " << slots.key(i) << " " << slots.value(i) << "\n";
     }
   }
 
 private:
-  [[nodiscard]] size_t get_slot(const K &key) const {
-    size_t h = key.hash() & (keys.size() - 1);
-    int i = 1;
-    while ((metadata[2 * i] || metadata[2 * i + 1]) && keys[i] <=> key != 0) {
-      h += i * (i + 1) / 2;
+  [[nodiscard]] size_t get_slot(const K &key, size_t hash) const {
+    size_t len;
+    return get_slot(key, hash, len);
+  }
+  // `len` is how many slots were looked at
+  size_t get_slot(const K &key, size_t hash, size_t &len) const {
+    // triangular steps, visits every slot of a power of two table
+    size_t h = hash & (current_size - 1);
+    size_t i = 1;
+    while (slots.used(h) && slots.key(h) != key) {
+      h = (h + i) & (current_size - 1);
       i++;
-      h &= (current_size - 1);
     }
+    len = i;
     return h;
   }
+  // no duplicate check and no growth, for keys known to be absent
+  void insert_unique(K &&key, V &&v) {
+    size_t h = key.hash() & (current_size - 1);
+    for (size_t i = 1; slots.used(h); i++) {
+      h = (h + i) & (current_size - 1);
+    }
+    slots.set_occupied(h);
+    slots.key(h) = std::move(key);
+    slots.value(h) = std::move(v);
+    effective_keys++;
+  }
+
   size_t num_keys = 0;
   size_t effective_keys = 0;
   size_t current_size = 16;
-  std::vector<K> keys;
-  std::vector<Value> values;
-  std::vector<bool>
-      metadata; // meta[2i] = occupied[i], meta[2i+1] = tombstone[i]
+  typename Layout::template storage<K, V, Alloc> slots;
+  [[no_unique_address]] stats_counters counters;
 };
 
 } // namespace crash
@@ -4,184 +4,538 @@
 #define CRASH_MULTI_HPP
 
 #include <atomic>
+#include <bit>
+#include <cstdint>
 #include <functional>
 #include <optional>
+#include <span>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 #include <iostream>
 
+#include "alloc.hpp"
 #include "common.hpp"
+#include "ebr.hpp"
+#include "stats.hpp"
 
 namespace crash {
 
+// how a slot keeps its value next to its flags, so the two always change in
+// one lock free CAS
+enum class value_cell {
+  packed, // flags and value in a word std::atomic swaps itself
+  wide,   // flags and value in 16 bytes, see wide_atomic
+  node,   // the value in a value_node of its own, the slot points at it
+};
+
+template <class V> struct packed_state {
+  int busy : 1;      // a writer is filling in the key
+  int keyed : 1;     // key is published
+  int occupied : 1;  // holds a live value
+  int tombstone : 1; // value was erased
+  int moved : 1;     // frozen by a resize, look in the next table
+  V value;
+};
+
+template <class V> struct alignas(32) value_node {
+  V value;
+};
+
+// the same flags, with a value_node's address shifted down past the bits its
+// alignment keeps clear. null unless occupied
+struct node_state {
+  uintptr_t busy : 1;
+  uintptr_t keyed : 1;
+  uintptr_t occupied : 1;
+  uintptr_t tombstone : 1;
+  uintptr_t moved : 1;
+  uintptr_t node : 59;
+};
+
+template <class V> constexpr value_cell cell_for() {
+  if constexpr (!std::is_trivially_copyable_v<V>)
+    return value_cell::node;
+  else if constexpr (std::atomic<packed_state<V>>::is_always_lock_free)
+    return value_cell::packed;
+#if defined(__x86_64__)
+  else if constexpr (sizeof(packed_state<V>) == 16)
+    return value_cell::wide;
+#endif
+  else
+    return value_cell::node;
+}
+
+// what a put holds on to and a slot stores: the value itself, or for `node`
+// a value_node that only belongs to the table once a CAS publishes it
+template <class V, value_cell C = cell_for<V>()> struct slot_value {
+  using state = packed_state<V>;
+  using atomic =
+      std::conditional_t<C == value_cell::wide, wide_atomic<state>,
+                         Atomic<state>>;
+  using stored = V;
+
+  static stored make(V v) { return v; }
+  static stored get(const state &s) { return s.value; }
+  static void set(state &s, const stored &x) { s.value = x; }
+  static void clear(state &) {}
+  static const V &value(const stored &x) { return x; }
+  // frees `x` right away, no reader can reach it
+  static void discard(const stored &) {}
+  // `s` was just replaced, see below
+  template <class Reclaim>
+  static void retire(const state &, const Reclaim &) {}
+};
+
+// a value_node is reachable from the slot it was put in and, once frozen,
+// from the copies of that slot in older tables. only replacing it in the
+// newest one (a put or erase that isn't stopped by `moved`) makes it
+// unreachable for anyone who looks from then on, so that retires it
+template <class V> struct slot_value<V, value_cell::node> {
+  using state = node_state;
+  using atomic = Atomic<state>;
+  using node = value_node<V>;
+  using stored = node *;
+
+  static stored make(V v) { return new node{std::move(v)}; }
+  static stored get(const state &s) {
+    return reinterpret_cast<node *>(uintptr_t(s.node) << 5);
+  }
+  static void set(state &s, stored x) {
+    s.node = reinterpret_cast<uintptr_t>(x) >> 5;
+  }
+  static void clear(state &s) { s.node = 0; }
+  static const V &value(stored x) { return x->value; }
+  static void discard(stored x) { delete x; }
+  template <class Reclaim>
+  static void retire(const state &s, const Reclaim &reclaim) {
+    if (s.occupied)
+      reclaim.retire(get(s));
+  }
+};
+
 template <class K, class V> struct alignas(64) kv_entry {
+  using cell = slot_value<V>;
+  using state = typename cell::state;
+  static_assert(std::is_trivially_copyable_v<state> &&
+                    cell::atomic::is_always_lock_free,
+                "a slot has to change in one lock free CAS");
+
   kv_entry() { memset(this, 0, sizeof(*this)); }
+  // written once while `busy` is set, never changes after `keyed` is set
   K key;
-  struct state {
-    int occupied : 1;
-    int tombstone : 1;
-    V value;
-  };
-  Atomic<state> s;
+  typename cell::atomic s;
 };
 
-template <class Key, class Value>
+// open addressing with triangular probing. slots are never reused for a
+// different key, so tombstones are only cleared out by a resize.
+//
+// resizing publishes a table twice the size as `next`. from then on every
+// put/erase that passes migrates a chunk of old slots, and the next table
+// becomes the top one once every old slot has been copied. a copied slot is
+// frozen (`moved`), and a put or erase that runs into a frozen slot finishes
+// that slot's copy and carries on in the next table. gets only read, see
+// get(). nothing ever waits for the whole migration to finish, except a
+// thread that needs to grow a table that is still being filled from its
+// predecessor.
+//
+// a slot's flags and value change together in one CAS, which stays lock free
+// for any V (see value_cell). values of up to 4 bytes share a word with the
+// flags, up to 8 bytes are swapped with cmpxchg16b on x86-64, and anything
+// bigger or not trivially copyable goes in a value_node.
+//
+// old tables and replaced value_nodes are handed to `Reclaim` (see ebr.hpp),
+// and every op holds its guard for as long as it looks at either.
+// ebr_reclaim frees them as soon as no op can still see them,
+// deferred_reclaim once the table is destroyed.
+template <class Key, class Value, class Alloc = slab_allocator<Key>,
+          class Reclaim = ebr_reclaim>
   requires Hashable<Key>
 class concurrent_hashtable {
 public:
   using K = Key;
   using V = Value;
   using table_entry = kv_entry<K, V>;
+  using state = typename table_entry::state;
+  using cell = typename table_entry::cell;
+  using stored = typename cell::stored;
 
-  concurrent_hashtable(size_t size = 16) : table(size), current_size(size){};
-  ~concurrent_hashtable(){};
+  concurrent_hashtable(size_t size = 16, const Alloc &alloc = Alloc())
+      : alloc(alloc),
+        top(new table(std::bit_ceil(std::max<size_t>(size, 16)), alloc)){};
+  ~concurrent_hashtable() {
+    // tables before `top` were retired already. a value lives in the newest
+    // table holding it, the frozen copies before it don't own it
+    for (table *t = top.load(); t;) {
+      table *n = t->next.load();
+      for (auto &e : t->slots) {
+        auto s = e.s.load(std::memory_order_relaxed);
+        if (s.occupied && !s.moved)
+          cell::discard(cell::get(s));
+      }
+      delete t;
+      t = n;
+    }
+  }
+  concurrent_hashtable(const concurrent_hashtable &) = delete;
+  concurrent_hashtable &operator=(const concurrent_hashtable &) = delete;
+
+  std::optional<V> get(const K &key) const { return get(key, key.hash()); }
 
-  std::optional<const std::reference_wrapper<const V>> get(const K &key) const {
-    // use quadratic probing
-    auto &entry = get_entry(key);
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    [[maybe_unused]] auto guard = reclaim.pin();
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { prefetch_slot(h); },
+        [&](size_t i, size_t h) { out[i] = get(ks[i], h); });
+  }
 
-    auto s = entry.s.load();
-    if (s.occupied) {
-      return s.value;
+  // never writes and never waits, so readers don't fight over cache lines
+  // with each other or with writers. a slot frozen by a resize keeps the
+  // value it had then, and that value stays current until a put or erase
+  // reaches the key in the next table. they always finish copying the slot
+  // first, so the next table only wins once it has a value or a tombstone
+  std::optional<V> get(const K &key, size_t hash) const {
+    [[maybe_unused]] auto guard = reclaim.pin();
+    table *t = top.load(std::memory_order_acquire);
+    size_t len = 0;
+    std::optional<stored> found;
+    for (table_entry *e; (e = find_slot(t, key, hash, mode::read, len));) {
+      auto s = e->s.load(std::memory_order_acquire);
+      if (s.occupied)
+        found = cell::get(s);
+      else if (s.tombstone)
+        found.reset();
+      if (!s.moved)
+        break;
+      if (!(t = t->next.load(std::memory_order_acquire)))
+        break;
     }
-    return {};
+    if (!found) {
+      counters.miss(len);
+      return std::nullopt;
+    }
+    counters.hit(len);
+    return cell::value(*found);
   }
 
-  void put(const K &key, V v) {
-    auto &entry = get_entry(key);
-    while (true) {
-      auto s = entry.s.load();
-      if (s.occupied) {
-        auto n_s = s;
-        s.value = v;
-        if (entry.s.compare_exchange_strong(s, n_s)) {
-          return;
-        }
-        // dont know what to do lol
-        continue;
-      }
+  void put(const K &key, V v) { put(key, v, key.hash()); }
 
-      // insert
-      num_keys++;
-      effective_keys++;
-      auto n_s = s;
-      n_s.tombstone = false;
-      n_s.occupied = true;
-      n_s.value = v;
-      if (!entry.s.compare_exchange_strong(s, n_s)) {
-        continue;
-      }
-      return;
-    }
+  void put_batch(std::span<const K> ks, std::span<const V> vs) {
+    [[maybe_unused]] auto guard = reclaim.pin();
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { prefetch_slot(h); },
+        [&](size_t i, size_t h) { put(ks[i], vs[i], h); });
+  }
 
-    // this is uhhh not great
-    // lets just... not do this for now!
-    // need to swap tables basically
-    /*
-    if (effective_keys * 2 > current_size) {
-      concurrent_hashtable x(current_size * 2);
-      int p = 0;
-      for (int i = 0; i < current_size; i++) {
-        p++;
-        if (occupied[i]) {
-          x.put(table[i].first, table[i].second);
+  void put(const K &key, V v, size_t hash) {
+    stored x = cell::make(std::move(v));
+    [[maybe_unused]] auto guard = reclaim.pin();
+    table *t = top.load(std::memory_order_acquire);
+    help_copy(t);
+    for (;;) {
+      table_entry *e = find_slot(t, key, hash, mode::insert);
+      auto s = e->s.load(std::memory_order_acquire);
+      for (;;) {
+        if (s.moved)
+          break;
+        auto n_s = s;
+        n_s.occupied = true;
+        n_s.tombstone = false;
+        cell::set(n_s, x);
+        if (e->s.compare_exchange_weak(s, n_s)) {
+          if (!s.occupied)
+            num_keys++;
+          cell::retire(s, reclaim);
+          return;
         }
-        x.put(key, v);
       }
-      std::swap(*this, x);
+      copy_slot(t, *e);
+      t = t->next.load(std::memory_order_acquire);
     }
-    */
   }
 
   bool erase(const K &key) {
-
-    auto &entry = get_entry(key);
-    while (true) {
-      auto s = entry.s.load();
-      if (s.occupied) {
-        num_keys--;
-        effective_keys--;
+    [[maybe_unused]] auto guard = reclaim.pin();
+    table *t = top.load(std::memory_order_acquire);
+    help_copy(t);
+    size_t hash = key.hash();
+    for (;;) {
+      table_entry *e = find_slot(t, key, hash, mode::read);
+      if (!e)
+        return false;
+      auto s = e->s.load(std::memory_order_acquire);
+      for (;;) {
+        if (s.moved)
+          break;
+        if (!s.occupied)
+          return false;
         auto n_s = s;
-        n_s.tombstone = true;
         n_s.occupied = false;
-        if (entry.s.compare_exchange_strong(s, n_s)) {
+        n_s.tombstone = true;
+        cell::clear(n_s);
+        if (e->s.compare_exchange_weak(s, n_s)) {
+          num_keys--;
+          cell::retire(s, reclaim);
           return true;
         }
-        continue;
       }
-      return false;
+      copy_slot(t, *e);
+      t = t->next.load(std::memory_order_acquire);
     }
   }
+  void prefetch(const K &key) const { prefetch_slot(key.hash()); }
   size_t size() const { return num_keys; }
-  size_t capacity() const { return current_size; }
+  size_t capacity() const {
+    [[maybe_unused]] auto guard = reclaim.pin();
+    return top.load()->capacity();
+  }
 
-  void dump() const {
-    for (int i = 0; i < current_size; i++) {
+  // see stats.hpp. the shape is a snapshot of the top table, and only exact
+  // while nothing is writing. displacement is in probe steps
+  table_stats stats() const {
+    table_stats s;
+    [[maybe_unused]] auto guard = reclaim.pin();
+    const table &t = *top.load(std::memory_order_acquire);
+    size_t mask = t.capacity() - 1;
+    scan_slots(s, slot_view{t}, t.capacity(), [&](size_t i) {
+      size_t h = t.slots[i].key.hash() & mask;
+      size_t len = 1;
+      for (size_t j = 1; h != i; j++, len++) {
+        h = (h + j) & mask;
+      }
+      return len;
+    });
+    counters.fill(s);
+    return s;
+  }
 
-      auto &entry = table[i];
+  void dump() const {
+    [[maybe_unused]] auto guard = reclaim.pin();
+    table *t = top.load();
+    for (size_t i = 0; i < t->capacity(); i++) {
+      auto &entry = t->slots[i];
       auto s = entry.s.load();
       if (s.occupied) {
-        std::cerr << i << ": " << entry.key << " " << s.value << "\n";
+        std::cerr << i << ": " << entry.key << " "
+                  << cell::value(cell::get(s)) << "\n";
       }
     }
   }
 
 private:
-  [[nodiscard]] inline size_t
-  get_slot(const K &key) const { // return a reference to the entry?
-    size_t h = key.hash() % table.size();
-    int i = 1;
-    auto entry = table[h];
-    auto s = entry.s.load();
-    while ((s.tombstone || s.occupied) && entry.key <=> key != 0) {
-      h += i;
-      i++;
-      h &= (current_size - 1);
-
-      entry = table[h];
-      s = entry.s.load();
+  // slots claimed per migration step
+  static constexpr size_t copy_chunk = 256;
+
+  struct table {
+    table(size_t n, const Alloc &alloc) : slots(n, alloc) {}
+    size_t capacity() const { return slots.size(); }
+
+    // read by every op
+    alloc_vector<table_entry, Alloc> slots;
+    std::atomic<table *> next = nullptr;
+    // written by puts and resizes, on lines of their own so gets never
+    // have theirs taken away
+    alignas(64) std::atomic<size_t> keyed = 0; // slots given a key
+    std::atomic<bool> resizing = false;
+    alignas(64) std::atomic<size_t> copy_idx = 0; // next chunk to hand out
+    alignas(64) std::atomic<size_t> copy_done = 0; // slots fully migrated
+  };
+
+  // a table through the interface scan_slots expects
+  struct slot_view {
+    const table &t;
+    bool occupied(size_t i) const { return t.slots[i].s.load().occupied; }
+    bool tombstone(size_t i) const { return t.slots[i].s.load().tombstone; }
+    bool used(size_t i) const { return t.slots[i].s.load().keyed; }
+  };
+
+  // the home slot in the top table, it may have moved on by the time it's used
+  void prefetch_slot(size_t hash) const {
+    [[maybe_unused]] auto guard = reclaim.pin();
+    table *t = top.load(std::memory_order_acquire);
+    prefetch_read(&t->slots[hash & (t->capacity() - 1)]);
+  }
+
+  // spin until a half-written key is published
+  static state load_keyed(const table_entry &e) {
+    auto s = e.s.load(std::memory_order_acquire);
+    while (s.busy) {
+      std::this_thread::yield();
+      s = e.s.load(std::memory_order_acquire);
     }
-    return h;
-  }
-  [[nodiscard]] inline const table_entry &get_entry(const K &key) const {
-    size_t h = key.hash() % table.size();
-    int i = 1;
-    auto entry = table[h];
-    auto s = entry.s.load();
-    std::cerr << std::boolalpha;
-    while ((s.tombstone || s.occupied) && entry.key <=> key != 0) {
-
-      h += i;
-      i++;
-      h &= (current_size - 1);
-
-      entry = table[h];
-      s = entry.s.load();
+    return s;
+  }
+
+  enum class mode {
+    read,   // never writes, may skip slots whose key is still being written
+    insert, // claims a slot if the key is absent
+    copy,   // like insert, but for a table still being filled by a resize
+  };
+
+  table_entry *find_slot(table *&t, const K &key, size_t hash, mode m) const {
+    size_t len;
+    return find_slot(t, key, hash, m, len);
+  }
+  // the slot holding `key`, starting at table `t` and following `next` as
+  // needed (`t` is updated to the table the slot is in). returns nullptr if
+  // the key is absent, or for `copy` if the slot was already frozen. the
+  // returned slot may have been frozen since, callers check `moved`. with
+  // CRASH_STATS, the slots looked at are added to `len`
+  table_entry *find_slot(table *&t, const K &key, size_t hash, mode m,
+                         size_t &len) const {
+    for (;;) {
+      size_t mask = t->capacity() - 1;
+      size_t h = hash & mask;
+      size_t i = 1;
+      for (;;) {
+        auto &e = t->slots[h];
+        if constexpr (stats_enabled)
+          len++;
+        auto s = m == mode::read ? e.s.load(std::memory_order_acquire)
+                                 : load_keyed(e);
+        if (s.keyed) {
+          if (e.key == key)
+            return &e;
+        } else if (s.moved) {
+          if (m == mode::copy)
+            return nullptr;
+          break;
+        } else if (!s.busy) {
+          // empty: the key was never in this table
+          if (m == mode::read)
+            return nullptr;
+          if (m == mode::insert) {
+            if (t->next.load(std::memory_order_acquire)) {
+              // don't start new keys in a table that is being migrated,
+              // freeze the slot so readers also know to look further
+              auto n_s = s;
+              n_s.moved = true;
+              e.s.compare_exchange_strong(s, n_s);
+              continue;
+            }
+            if (2 * t->keyed.load() >= t->capacity()) {
+              start_resize(t);
+              continue;
+            }
+          }
+          auto n_s = s;
+          n_s.busy = true;
+          if (!e.s.compare_exchange_strong(s, n_s))
+            continue;
+          e.key = key;
+          n_s.busy = false;
+          n_s.keyed = true;
+          e.s.store(n_s, std::memory_order_release);
+          t->keyed++;
+          return &e;
+        }
+        // a busy slot is only skipped when reading, the key being written
+        // can't have been visible yet
+        h = (h + i) & mask;
+        i++;
+      }
+      table *n = t->next.load(std::memory_order_acquire);
+      if (!n)
+        return nullptr;
+      t = n;
     }
-    return table[h];
-  }
-  // either returns the right kv_pair, or just returns an empty cell
-  [[nodiscard]] inline table_entry &get_entry(const K &key) {
-    size_t h = key.hash() % table.size();
-    int i = 1;
-    auto entry = table[h];
-    auto s = entry.s.load();
-    std::cerr << std::boolalpha;
-    while ((s.tombstone || s.occupied) && entry.key <=> key != 0) {
-
-      h += i;
-      i++;
-      h &= (current_size - 1);
-
-      entry = table[h];
-      s = entry.s.load();
+  }
+
+  void start_resize(table *t) const {
+    // the previous table has to be fully moved into `t` first, otherwise a
+    // late copy could land in t->next and resurrect an erased key. never
+    // called while holding a chunk, so this can't wait on itself
+    for (;;) {
+      if (t->next.load(std::memory_order_acquire))
+        return;
+      table *cur = top.load(std::memory_order_acquire);
+      if (cur == t)
+        break;
+      if (!help_copy(cur))
+        std::this_thread::yield();
+    }
+    if (t->resizing.exchange(true)) {
+      while (!t->next.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      return;
+    }
+    [[maybe_unused]] auto timer = counters.time_resize();
+    counters.resized();
+    size_t n = t->capacity();
+    if (4 * num_keys.load() >= n)
+      n *= 2;
+    t->next.store(new table(n, alloc), std::memory_order_release);
+  }
+
+  // migrate one chunk of `t` if it is being resized, false if there was
+  // nothing left to hand out
+  bool help_copy(table *t) const {
+    if (!t->next.load(std::memory_order_acquire))
+      return false;
+    size_t cap = t->capacity();
+    size_t start = t->copy_idx.fetch_add(copy_chunk);
+    if (start >= cap)
+      return false;
+    [[maybe_unused]] auto timer = counters.time_resize();
+    size_t end = std::min(start + copy_chunk, cap);
+    for (size_t i = start; i < end; i++) {
+      copy_slot(t, t->slots[i]);
+    }
+    if (t->copy_done.fetch_add(end - start) + (end - start) == cap) {
+      // nothing new can reach `t` now, only ops that already had it
+      table *expected = t;
+      if (top.compare_exchange_strong(expected, t->next.load()))
+        reclaim.retire(t);
+    }
+    return true;
+  }
+
+  // freeze a slot and make sure its value is in the next table. safe to run
+  // any number of times on the same slot
+  void copy_slot(table *t, table_entry &e) const {
+    auto s = load_keyed(e);
+    while (!s.moved) {
+      auto n_s = s;
+      n_s.moved = true;
+      if (e.s.compare_exchange_weak(s, n_s)) {
+        s = n_s;
+        break;
+      }
+      s = load_keyed(e);
     }
-    return table[h];
+    if (s.occupied)
+      copy_into(t->next.load(std::memory_order_acquire), e.key, cell::get(s));
   }
-  std::atomic<size_t> num_keys = 0;
-  std::atomic<size_t> effective_keys = 0;
-  std::atomic<size_t> current_size = 16;
-  std::vector<table_entry> table;
+
+  // only fills a slot whose value was never set, so anything written to the
+  // next table since the freeze wins over the copy. a value_node is shared
+  // with the frozen slot rather than copied
+  void copy_into(table *t, const K &key, stored x) const {
+    table_entry *e = find_slot(t, key, key.hash(), mode::copy);
+    if (!e)
+      return;
+    auto s = e->s.load(std::memory_order_acquire);
+    while (!s.moved && !s.occupied && !s.tombstone) {
+      auto n_s = s;
+      n_s.occupied = true;
+      cell::set(n_s, x);
+      if (e->s.compare_exchange_weak(s, n_s))
+        return;
+    }
+  }
+
+  // where every table's slots come from, see numa_allocator for one that
+  // isn't empty
+  [[no_unique_address]] Alloc alloc;
+  mutable std::atomic<table *> top;
+  // every put of a new key and every erase, away from `top`
+  alignas(64) mutable std::atomic<size_t> num_keys = 0;
+  [[no_unique_address]] stats_counters counters;
+  [[no_unique_address]] Reclaim reclaim;
 };
 
 } // namespace crash
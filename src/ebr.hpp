@@ -0,0 +1,270 @@
+#pragma once
+
+#ifndef EBR_HPP
+#define EBR_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace crash {
+
+// epoch based reclamation, for memory a lock free reader might still be
+// looking at when a writer unlinks it: old slot arrays after a resize, out
+// of line values after a put. the writer retires it instead of freeing it,
+// and it's freed once every reader that could have seen it has left.
+//
+// readers hold an ebr_guard while they touch shared memory. a guard pins
+// its thread to the global epoch, and the epoch only moves on once every
+// pinned thread has seen the current one. so anything retired in epoch e
+// is unreachable by the time the epoch is e + 2.
+//
+// a guard is a thread local lookup, a counter and, for the outermost one,
+// a store to the thread's own line. pinning has to be seen before anything
+// the guard reads, which takes a full fence, and a fence on every op stalls
+// it until the misses of the op before are back. so where linux has
+// membarrier, the collector fences every thread of the process with it
+// instead, and guards never fence. elsewhere the store is an exchange. each
+// thread keeps what it retired in a list of its own and frees it in
+// batches, whenever it has retired or left guards `collect_every` times
+// since the last try while it had something to free. a thread that goes
+// quiet holds on to its list until it's active again or exits, when the
+// others take it over
+class ebr_domain {
+public:
+  // tries to move the epoch on, and frees what's safe, this often
+  static constexpr size_t collect_every = 64;
+
+  // never destroyed, so threads that outlive main can still retire into it
+  static ebr_domain &shared() {
+    static ebr_domain *domain = new ebr_domain();
+    return *domain;
+  }
+
+  // false if the thread was pinned already, only the outermost enter()
+  // is matched by an exit()
+  bool enter() {
+    record &r = local();
+    if (r.pinned.load(std::memory_order_relaxed) & 1)
+      return false;
+    uint64_t p = epoch.load(std::memory_order_relaxed) << 1 | 1;
+    if (asymmetric) {
+      r.pinned.store(p, std::memory_order_relaxed);
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+    } else {
+      // an exchange rather than a store, so a collector that sees this pin
+      // also sees every guard this thread left before it
+      r.pinned.exchange(p);
+    }
+    return true;
+  }
+  void exit() {
+    record &r = local();
+    r.pinned.store(0, std::memory_order_release);
+    if (!r.limbo.empty() && ++r.since_collect >= collect_every)
+      collect(r);
+  }
+
+  // free(p) once no guard can still see p. p has to be unreachable already
+  void retire(void *p, void (*free)(void *)) {
+    record &r = local();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    r.limbo.push_back({p, free, epoch.load(std::memory_order_relaxed)});
+    if (++r.since_collect >= collect_every)
+      collect(r);
+  }
+  template <class T> void retire(T *p) {
+    retire(p, [](void *q) { delete static_cast<T *>(q); });
+  }
+
+private:
+  struct retired {
+    void *p;
+    void (*free)(void *);
+    uint64_t epoch;
+  };
+
+  struct alignas(64) record {
+    std::atomic<uint64_t> pinned = 0; // epoch << 1 | 1 while in a guard
+    std::atomic<bool> in_use = true;
+    record *next = nullptr;
+    size_t since_collect = 0;
+    std::vector<retired> limbo;
+  };
+
+  record &local() {
+    static thread_local record *mine = nullptr;
+    if (!mine) [[unlikely]]
+      mine = adopt();
+    return *mine;
+  }
+
+  // a record for the calling thread, taken over from an exited thread if
+  // there is one. on exit whatever it hasn't freed yet is left to the others
+  record *adopt() {
+    struct owner {
+      ebr_domain &d;
+      record *r;
+      explicit owner(ebr_domain &d) : d(d), r(d.acquire()) {}
+      ~owner() { d.release(*r); }
+    };
+    static thread_local owner o(*this);
+    return o.r;
+  }
+
+  record *acquire() {
+    for (record *r = records.load(std::memory_order_acquire); r; r = r->next) {
+      if (!r->in_use.load(std::memory_order_relaxed) &&
+          !r->in_use.exchange(true, std::memory_order_acquire))
+        return r;
+    }
+    record *r = new record();
+    r->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r)) {
+    }
+    return r;
+  }
+
+  void release(record &r) {
+    {
+      std::lock_guard l(orphans_lock);
+      orphans.insert(orphans.end(), r.limbo.begin(), r.limbo.end());
+    }
+    r.limbo.clear();
+    r.since_collect = 0;
+    r.in_use.store(false, std::memory_order_release);
+  }
+
+  // moves the epoch on if every pinned thread has seen it, then frees what
+  // was retired two or more epochs ago
+  void collect(record &self) {
+    self.since_collect = 0;
+    if (asymmetric)
+      fence_all();
+    else
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t e = epoch.load(std::memory_order_acquire);
+    bool behind = false;
+    for (record *r = records.load(std::memory_order_acquire); r && !behind;
+         r = r->next) {
+      uint64_t p = r->pinned.load(std::memory_order_acquire);
+      behind = (p & 1) && p >> 1 != e;
+    }
+    if (!behind && epoch.compare_exchange_strong(e, e + 1))
+      e++;
+    free_before(self.limbo, e - 1);
+    // never waits on an exiting thread
+    if (orphans_lock.try_lock()) {
+      free_before(orphans, e - 1);
+      orphans_lock.unlock();
+    }
+  }
+
+  static void free_before(std::vector<retired> &limbo, uint64_t e) {
+    std::erase_if(limbo, [e](const retired &x) {
+      if (x.epoch >= e)
+        return false;
+      x.free(x.p);
+      return true;
+    });
+  }
+
+#if defined(__linux__) && defined(SYS_membarrier) &&                        \
+    !defined(__SANITIZE_THREAD__)
+  // tsan can't see what membarrier orders, it gets the exchange
+  static bool register_fence_all() {
+    return syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED,
+                   0, 0) == 0;
+  }
+  // a full fence on every running thread of the process
+  static void fence_all() {
+    syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+  }
+#else
+  static bool register_fence_all() { return false; }
+  static void fence_all() {}
+#endif
+
+  ebr_domain() : asymmetric(register_fence_all()) {}
+
+  const bool asymmetric; // guards leave fencing to fence_all()
+  alignas(64) std::atomic<uint64_t> epoch = 2;
+  alignas(64) std::atomic<record *> records = nullptr;
+  std::mutex orphans_lock;
+  std::vector<retired> orphans; // left by threads that exited
+};
+
+// pins the calling thread for as long as it lives
+class ebr_guard {
+public:
+  explicit ebr_guard(ebr_domain &d = ebr_domain::shared())
+      : d(d), outer(d.enter()) {}
+  ~ebr_guard() {
+    if (outer)
+      d.exit();
+  }
+  ebr_guard(const ebr_guard &) = delete;
+  ebr_guard &operator=(const ebr_guard &) = delete;
+
+private:
+  ebr_domain &d;
+  bool outer;
+};
+
+// how a concurrent engine frees what its readers might still be looking
+// at. it holds pin() over every access to shared memory and hands whatever
+// it unlinks to retire()
+
+// through ebr_domain::shared()
+struct ebr_reclaim {
+  ebr_guard pin() const { return ebr_guard(); }
+  template <class T> void retire(T *p) const {
+    ebr_domain::shared().retire(p);
+  }
+};
+
+// no guards, and nothing retired is freed before the reclaimer itself is
+// destroyed, along with the engine. for engines that only grow, and as the
+// baseline ebr_reclaim's guards are measured against
+class deferred_reclaim {
+public:
+  struct guard {};
+  guard pin() const { return {}; }
+  template <class T> void retire(T *p) const {
+    auto *n = new retired{p, [](void *q) { delete static_cast<T *>(q); }};
+    n->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(n->next, n)) {
+    }
+  }
+
+  deferred_reclaim() = default;
+  deferred_reclaim(const deferred_reclaim &) = delete;
+  deferred_reclaim &operator=(const deferred_reclaim &) = delete;
+  ~deferred_reclaim() {
+    for (retired *n = head.load(); n;) {
+      retired *next = n->next;
+      n->free(n->p);
+      delete n;
+      n = next;
+    }
+  }
+
+private:
+  struct retired {
+    void *p;
+    void (*free)(void *);
+    retired *next = nullptr;
+  };
+  mutable std::atomic<retired *> head = nullptr;
+};
+
+} // namespace crash
+
+#endif
@@ -0,0 +1,109 @@
+#pragma once
+
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "common.hpp"
+
+namespace crash {
+
+// wyhash (final version 4 layout): 8 bytes at a time, every block folded in
+// with a 64x64->128 multiply, so all the input bits reach the low bits the
+// engines mask with. djb2 only moves entropy upwards, so short keys that
+// differ near the end end up next to each other under `& (capacity - 1)`
+namespace wy {
+constexpr uint64_t p0 = 0x2d358dccaa6c78a5ULL;
+constexpr uint64_t p1 = 0x8bb84b93962eacc9ULL;
+constexpr uint64_t p2 = 0x4b33a62ed433d4a3ULL;
+constexpr uint64_t p3 = 0x4d5a2da51de1aa47ULL;
+
+inline void mum(uint64_t &a, uint64_t &b) {
+  __uint128_t r = __uint128_t(a) * b;
+  a = uint64_t(r);
+  b = uint64_t(r >> 64);
+}
+inline uint64_t mix(uint64_t a, uint64_t b) {
+  mum(a, b);
+  return a ^ b;
+}
+inline uint64_t r8(const uint8_t *p) {
+  uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+inline uint64_t r4(const uint8_t *p) {
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+// 1-3 bytes, first, middle and last
+inline uint64_t r3(const uint8_t *p, size_t k) {
+  return (uint64_t(p[0]) << 16) | (uint64_t(p[k >> 1]) << 8) | p[k - 1];
+}
+} // namespace wy
+
+inline uint64_t wyhash64(const void *key, size_t len, uint64_t seed = 0) {
+  const uint8_t *p = static_cast<const uint8_t *>(key);
+  seed ^= wy::mix(seed ^ wy::p0, wy::p1);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wy::r4(p) << 32) | wy::r4(p + ((len >> 3) << 2));
+      b = (wy::r4(p + len - 4) << 32) | wy::r4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wy::r3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wy::mix(wy::r8(p) ^ wy::p1, wy::r8(p + 8) ^ seed);
+        see1 = wy::mix(wy::r8(p + 16) ^ wy::p2, wy::r8(p + 24) ^ see1);
+        see2 = wy::mix(wy::r8(p + 32) ^ wy::p3, wy::r8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wy::mix(wy::r8(p) ^ wy::p1, wy::r8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wy::r8(p + i - 16);
+    b = wy::r8(p + i - 8);
+  }
+  a ^= wy::p1;
+  b ^= seed;
+  wy::mum(a, b);
+  return wy::mix(a ^ wy::p0 ^ len, b ^ wy::p1);
+}
+
+// drop-in `hash_fn` for string_wrapper, and a `Hash` for string_key
+struct wyhash {
+  size_t operator()(std::string_view s) const {
+    return wyhash64(s.data(), s.size());
+  }
+  // the whole zero padded buffer, so there is no end to look for first
+  template <class H> size_t operator()(const string_wrapper<H> &s) const {
+    return wyhash64(s.s, sizeof(s.s));
+  }
+};
+
+typedef string_wrapper<wyhash> FastString;
+
+struct gen_fast_string {
+  FastString get() const { return FastString(gen_string::generate(30)); }
+};
+
+} // namespace crash
+
+#endif
@@ -0,0 +1,284 @@
+#pragma once
+
+#ifndef LAYOUT_HPP
+#define LAYOUT_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+#include "alloc.hpp"
+#include "common.hpp"
+
+namespace crash {
+
+// every slot is empty, occupied, or a tombstone (erased, but probes still
+// have to walk past it). the engines only talk to their slots through a
+// layout's storage<K, V, Alloc>, so where the state lives is a template
+// parameter. keys and values come from `Alloc`, the small state arrays from
+// the global allocator:
+//
+//   soa<packed_meta>  keys, values, and 2 bit states packed into words
+//   soa<byte_meta>    keys, values, and a byte of state per slot
+//   interleaved       {state, key} buckets, values on the side
+//   aos               {key, value, state} buckets
+enum slot_state : uint8_t {
+  slot_empty = 0,
+  slot_occupied = 1,
+  slot_tombstone = 2,
+};
+
+// 32 slots to a 64 bit word, so a probe's state is almost always in one line
+// and whole words of empty slots can be skipped at once
+class packed_meta {
+public:
+  packed_meta(size_t n = 0) : words((n + 31) / 32, 0) {}
+
+  template <class F> void arrays(F &&f) { f(words); }
+  template <class F> void arrays(F &&f) const { f(words); }
+
+  bool occupied(size_t i) const { return state(i) & slot_occupied; }
+  bool tombstone(size_t i) const { return state(i) & slot_tombstone; }
+  bool used(size_t i) const { return state(i) != slot_empty; }
+  void set(size_t i, slot_state s) {
+    uint64_t &w = words[i / 32];
+    unsigned shift = 2 * (i % 32);
+    w = (w & ~(3ULL << shift)) | (uint64_t(s) << shift);
+  }
+  void clear() { std::fill(words.begin(), words.end(), 0); }
+
+  // first occupied slot at or after i, or something past the end
+  size_t next_occupied(size_t i) const {
+    size_t w = i / 32;
+    if (w >= words.size())
+      return i;
+    uint64_t m = words[w] & occupied_bits & (~0ULL << (2 * (i % 32)));
+    while (!m) {
+      if (++w == words.size())
+        return w * 32;
+      m = words[w] & occupied_bits;
+    }
+    return w * 32 + std::countr_zero(m) / 2;
+  }
+
+  const void *address(size_t i) const { return &words[i / 32]; }
+  uint64_t bytes() const { return words.capacity() * sizeof(uint64_t); }
+
+private:
+  static constexpr uint64_t occupied_bits = 0x5555555555555555ULL;
+  slot_state state(size_t i) const {
+    return slot_state((words[i / 32] >> (2 * (i % 32))) & 3);
+  }
+
+  slot_array<uint64_t, std::allocator<uint64_t>> words;
+};
+
+class byte_meta {
+public:
+  byte_meta(size_t n = 0) : states(n, slot_empty) {}
+
+  template <class F> void arrays(F &&f) { f(states); }
+  template <class F> void arrays(F &&f) const { f(states); }
+
+  bool occupied(size_t i) const { return states[i] == slot_occupied; }
+  bool tombstone(size_t i) const { return states[i] == slot_tombstone; }
+  bool used(size_t i) const { return states[i] != slot_empty; }
+  void set(size_t i, slot_state s) { states[i] = s; }
+  void clear() { std::fill(states.begin(), states.end(), slot_empty); }
+
+  size_t next_occupied(size_t i) const {
+    while (i < states.size() && states[i] != slot_occupied) {
+      i++;
+    }
+    return i;
+  }
+
+  const void *address(size_t i) const { return &states[i]; }
+  uint64_t bytes() const { return states.capacity(); }
+
+private:
+  slot_array<uint8_t, std::allocator<uint8_t>> states;
+};
+
+// keys and values in their own arrays, state kept by `Meta`
+template <class Meta = packed_meta> struct soa {
+  template <class K, class V, class Alloc = slab_allocator<K>> class storage {
+  public:
+    storage(size_t n = 0) : keys(n), values(n), meta(n) {}
+
+    // every array behind the slots, always in the same order, so a
+    // snapshot can write them out and borrow them back
+    template <class F> void arrays(F &&f) {
+      f(keys);
+      f(values);
+      meta.arrays(f);
+    }
+    template <class F> void arrays(F &&f) const {
+      f(keys);
+      f(values);
+      meta.arrays(f);
+    }
+
+    size_t capacity() const { return keys.size(); }
+    K &key(size_t i) { return keys[i]; }
+    const K &key(size_t i) const { return keys[i]; }
+    V &value(size_t i) { return values[i]; }
+    const V &value(size_t i) const { return values[i]; }
+
+    bool occupied(size_t i) const { return meta.occupied(i); }
+    bool tombstone(size_t i) const { return meta.tombstone(i); }
+    bool used(size_t i) const { return meta.used(i); }
+    void set_occupied(size_t i) { meta.set(i, slot_occupied); }
+    void set_tombstone(size_t i) { meta.set(i, slot_tombstone); }
+    void set_empty(size_t i) { meta.set(i, slot_empty); }
+
+    // every slot empty, allocation kept
+    void clear() { meta.clear(); }
+    // first occupied slot at or after i, or capacity() if there is none
+    size_t next_occupied(size_t i) const {
+      return std::min(meta.next_occupied(i), capacity());
+    }
+
+    // everything a probe starting at i reads
+    void prefetch(size_t i) const {
+      prefetch_read(meta.address(i));
+      prefetch_read(&keys[i]);
+      prefetch_read(&values[i]);
+    }
+    uint64_t bytes() const {
+      return sizeof(K) * keys.capacity() + sizeof(V) * values.capacity() +
+             meta.bytes();
+    }
+
+  private:
+    slot_array<K, Alloc> keys;
+    slot_array<V, Alloc> values;
+    Meta meta;
+  };
+};
+
+// the state byte sits next to its key, so each probe step reads a single
+// line. values are only touched on a hit
+struct interleaved {
+  template <class K, class V, class Alloc = slab_allocator<K>> class storage {
+  public:
+    storage(size_t n = 0) : buckets(n), values(n) {}
+
+    template <class F> void arrays(F &&f) {
+      f(buckets);
+      f(values);
+    }
+    template <class F> void arrays(F &&f) const {
+      f(buckets);
+      f(values);
+    }
+
+    size_t capacity() const { return buckets.size(); }
+    K &key(size_t i) { return buckets[i].key; }
+    const K &key(size_t i) const { return buckets[i].key; }
+    V &value(size_t i) { return values[i]; }
+    const V &value(size_t i) const { return values[i]; }
+
+    bool occupied(size_t i) const {
+      return buckets[i].state == slot_occupied;
+    }
+    bool tombstone(size_t i) const {
+      return buckets[i].state == slot_tombstone;
+    }
+    bool used(size_t i) const { return buckets[i].state != slot_empty; }
+    void set_occupied(size_t i) { buckets[i].state = slot_occupied; }
+    void set_tombstone(size_t i) { buckets[i].state = slot_tombstone; }
+    void set_empty(size_t i) { buckets[i].state = slot_empty; }
+
+    void clear() {
+      for (auto &b : buckets) {
+        b.state = slot_empty;
+      }
+    }
+    size_t next_occupied(size_t i) const {
+      while (i < buckets.size() && buckets[i].state != slot_occupied) {
+        i++;
+      }
+      return i;
+    }
+
+    void prefetch(size_t i) const {
+      prefetch_read(&buckets[i]);
+      prefetch_read(&values[i]);
+    }
+    uint64_t bytes() const {
+      return sizeof(bucket) * buckets.capacity() +
+             sizeof(V) * values.capacity();
+    }
+
+  private:
+    struct bucket {
+      uint8_t state = slot_empty;
+      K key;
+    };
+    slot_array<bucket, Alloc> buckets;
+    slot_array<V, Alloc> values;
+  };
+};
+
+// everything for a slot in one bucket, so a hit costs a single line as long
+// as the bucket fits in one (String keys with 8 byte values are 48 bytes).
+// the state goes last so it packs into the value's tail padding
+struct aos {
+  template <class K, class V, class Alloc = slab_allocator<K>> class storage {
+  public:
+    storage(size_t n = 0) : buckets(n) {}
+
+    template <class F> void arrays(F &&f) { f(buckets); }
+    template <class F> void arrays(F &&f) const { f(buckets); }
+
+    size_t capacity() const { return buckets.size(); }
+    K &key(size_t i) { return buckets[i].key; }
+    const K &key(size_t i) const { return buckets[i].key; }
+    V &value(size_t i) { return buckets[i].value; }
+    const V &value(size_t i) const { return buckets[i].value; }
+
+    bool occupied(size_t i) const {
+      return buckets[i].state == slot_occupied;
+    }
+    bool tombstone(size_t i) const {
+      return buckets[i].state == slot_tombstone;
+    }
+    bool used(size_t i) const { return buckets[i].state != slot_empty; }
+    void set_occupied(size_t i) { buckets[i].state = slot_occupied; }
+    void set_tombstone(size_t i) { buckets[i].state = slot_tombstone; }
+    void set_empty(size_t i) { buckets[i].state = slot_empty; }
+
+    void clear() {
+      for (auto &b : buckets) {
+        b.state = slot_empty;
+      }
+    }
+    size_t next_occupied(size_t i) const {
+      while (i < buckets.size() && buckets[i].state != slot_occupied) {
+        i++;
+      }
+      return i;
+    }
+
+    // a bucket can straddle two lines
+    void prefetch(size_t i) const {
+      prefetch_read(&buckets[i]);
+      prefetch_read(&buckets[i].state);
+    }
+    uint64_t bytes() const { return sizeof(bucket) * buckets.capacity(); }
+
+  private:
+    struct bucket {
+      K key;
+      V value;
+      uint8_t state = slot_empty;
+    };
+    slot_array<bucket, Alloc> buckets;
+  };
+};
+
+} // namespace crash
+
+#endif
@@ -3,109 +3,365 @@
 #ifndef LINEAR_HPP
 #define LINEAR_HPP
 
+#include <algorithm>
+#include <bit>
 #include <optional>
+#include <span>
+#include <utility>
 #include <vector>
 
+#include "bulk.hpp"
 #include "common.hpp"
+#include "layout.hpp"
+#include "probe.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
 
 namespace crash {
 
-template <class Key, class Value, int LoadFactor>
+// erase shifts the rest of the key's cluster back instead of leaving a
+// tombstone, so `slots` never holds any and churn can't fill the table up.
+//
+// with `Incremental`, crossing the load factor doesn't rehash inside that
+// put. the full array is kept as `old` next to one twice its size, and every
+// put/erase after that moves the next `resize_step` old slots over. lookups
+// check the new array first, then the old one until it is drained. moved and
+// erased old slots become tombstones, so probes in `old` still get past them
+template <class Key, class Value, int LoadFactor, class Layout = soa<>,
+          bool Incremental = false, class Alloc = slab_allocator<Key>>
   requires Hashable<Key>
 class linear {
+  using storage = typename Layout::template storage<Key, Value, Alloc>;
 
 public:
   using K = Key;
   using V = Value;
-  double LF = LoadFactor / 100.0;
+  static constexpr double LF = LoadFactor / 100.0;
 
-  linear(size_t size_ = 16)
-      : capacity(size_), keys(size_), values(size_), meta(2 * size_) {}
+  linear(size_t size_ = 16) : capacity(size_), slots(size_) {}
 
-  std::optional<V> get(const K &k) const {
-    size_t h = k.hash() & (capacity - 1);
-    bool res;
-    for (res = false;
-         (meta[2 * h] || meta[2 * h + 1]) && (res = (k != keys[h]));) {
-      h = (h + 1) & (capacity - 1);
+  std::optional<V> get(const K &k) const { return get(k, k.hash()); }
+  // by anything a key compares equal to, e.g. a string_view for string_key,
+  // without building a key first
+  template <Lookup<K> Q> std::optional<V> get(const Q &q) const {
+    return get(q, K::hash_of(q));
+  }
+
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { slots.prefetch(h & (capacity - 1)); },
+        [&](size_t i, size_t h) { out[i] = get(ks[i], h); });
+  }
+
+  template <class Q> std::optional<V> get(const Q &k, size_t hash) const {
+    size_t len, old_len = 0;
+    size_t h = probe(slots, capacity, k, hash, len);
+    if (slots.occupied(h)) {
+      counters.hit(len);
+      return slots.value(h);
     }
-    if (meta[2 * h]) {
-      return values[h];
+    if (migrating()) {
+      h = probe(old, old_capacity, k, hash, old_len);
+      if (old.occupied(h)) {
+        counters.hit(len + old_len);
+        return old.value(h);
+      }
     }
+    counters.miss(len + old_len);
     return {};
   }
 
   V find(const K &k) const {
-    size_t h = k.hash() & (capacity - 1);
-    while ((meta[2 * h] || meta[2 * h + 1]) && (k != keys[h])) {
-      h = (h + 1) & (capacity - 1);
+    size_t h = probe(slots, capacity, k, k.hash());
+    if (!slots.occupied(h) && migrating()) {
+      size_t o = probe(old, old_capacity, k, k.hash());
+      if (old.occupied(o))
+        return old.value(o);
     }
-    return values[h];
+    return slots.value(h);
   }
-  void put(const K &k, V v) {
-    size_t h = k.hash() & (capacity - 1);
-    while ((meta[2 * h] || meta[2 * h + 1]) && (k != keys[h])) {
-      h = (h + 1) & (capacity - 1);
-    }
-    if (meta[2 * h]) {
+  void put(const K &k, V v) { put(k, v, k.hash()); }
+
+  void put_batch(std::span<const K> ks, std::span<const V> vs) {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { slots.prefetch(h & (capacity - 1)); },
+        [&](size_t i, size_t h) { put(ks[i], vs[i], h); });
+  }
+
+  void put(const K &k, V v, size_t hash) {
+    if (migrating())
+      migrate_step();
+    size_t h = probe(slots, capacity, k, hash);
+    if (slots.occupied(h)) {
       // occupied, so its the value is here?
-      values[h] = v;
+      slots.value(h) = v;
       return;
     }
+    if (migrating()) {
+      // moving it over now, the old copy is dropped
+      size_t o = probe(old, old_capacity, k, hash);
+      if (old.occupied(o)) {
+        old.set_tombstone(o);
+        sz--;
+      }
+    }
 
     sz++;
     effective_size++;
-    meta[2 * h] = true;
-    meta[2 * h + 1] = false;
-    keys[h] = k;
-    values[h] = v;
+    slots.set_occupied(h);
+    slots.key(h) = k;
+    slots.value(h) = v;
     if (effective_size >= capacity * LF) {
-      linear replacement(2 * capacity);
-      for (int i = 0; i < capacity; i++) {
-        if (meta[2 * i]) {
-          replacement.put(keys[i], values[i]);
-        }
-      }
-      std::swap(replacement, *this);
+      grow();
     }
   }
   void erase(const K &k) {
-    size_t h = k.hash() & (capacity - 1);
-    while ((meta[2 * h] || meta[2 * h + 1]) && (k != keys[h])) {
-      h = (h + 1) & (capacity - 1);
-    }
-    if (meta[2 * h]) {
-      meta[2 * h] = false;
-      meta[2 * h + 1] = true;
+    if (migrating())
+      migrate_step();
+    size_t h = probe(slots, capacity, k, k.hash());
+    if (slots.occupied(h)) {
+      remove(h);
       sz--;
+    } else if (migrating()) {
+      h = probe(old, old_capacity, k, k.hash());
+      if (old.occupied(h)) {
+        old.set_tombstone(h);
+        sz--;
+      }
+    }
+    if (sz < capacity * LF * low_water)
+      shrink();
+  }
+
+  // room for n keys before the next resize
+  void reserve(size_t n) { rehash(size_t(n / LF) + 1); }
+
+  // put every keys[i], values[i], the same as that many puts would. into an
+  // empty table it's a parallel build on `threads` threads (0 is one per
+  // core), see bulk.hpp. into one that isn't, a reserve and then the puts
+  void bulk_load(std::span<const K> keys, std::span<const V> values,
+                 size_t threads = 0) {
+    if (sz) {
+      reserve(sz + keys.size());
+      for (size_t i = 0; i < keys.size(); i++) {
+        put(keys[i], values[i]);
+      }
+      return;
+    }
+    size_t n = size_t(keys.size() / LF) + 1;
+    n = std::bit_ceil(std::max({n, capacity, size_t(16)}));
+    slots = storage(n);
+    capacity = n;
+    old = storage();
+    old_capacity = 0;
+    std::vector<size_t> spill;
+    sz = effective_size = bulk_fill(
+        slots, n, keys, values, threads, spill,
+        // keys come in by home slot, so the next free slot is right after
+        // the last one filled
+        [](const storage &, size_t home, size_t next, size_t) {
+          return std::max(home, next);
+        });
+    for (size_t i : spill) {
+      put(keys[i], values[i]);
     }
   }
 
+  // rebuild with at least n slots, or as many as the current keys need
+  void rehash(size_t n) {
+    while (migrating()) {
+      migrate_step();
+    }
+    [[maybe_unused]] auto timer = counters.time_resize();
+    counters.resized();
+    n = std::bit_ceil(std::max({n, size_t(sz / LF) + 1, size_t(16)}));
+    storage prev = std::exchange(slots, storage(n));
+    size_t prev_capacity = std::exchange(capacity, n);
+    effective_size = 0;
+    for (size_t i = prev.next_occupied(0); i < prev_capacity;
+         i = prev.next_occupied(i + 1)) {
+      insert_unique(std::move(prev.key(i)), std::move(prev.value(i)));
+    }
+  }
+
+  // rebuild at the smallest capacity the keys fit in, and hand what that
+  // frees back to the system
+  void shrink_to_fit() {
+    rehash(0);
+    release_cached<Alloc>();
+  }
+
+  // once an erase takes size() below `fraction` of what capacity() holds at
+  // the load factor, the table is rebuilt at most half full at it. 0 (the
+  // default) never shrinks. capped at 1/8, so after a shrink the size has
+  // to double or halve again before the next resize either way
+  void set_low_water(double fraction) {
+    low_water = std::clamp(fraction, 0.0, 0.125);
+  }
+
   void clear() {
     sz = 0;
     effective_size = 0;
-    keys.clear();
-    values.clear();
-    meta.clear();
+    slots.clear();
+    old = storage();
+    old_capacity = 0;
   }
 
-  size_t prefetch(const K &k) {
-    size_t h = k.hash() & (capacity - 1);
-    return h;
+  void prefetch(const K &k) const {
+    slots.prefetch(k.hash() & (capacity - 1));
   }
   size_t size() const { return sz; }
+
+  // f(key, value) for every key, in no particular order
+  template <class F> void for_each(F &&f) const {
+    auto each = [&f](const storage &st, size_t cap) {
+      for (size_t i = st.next_occupied(0); i < cap;
+           i = st.next_occupied(i + 1)) {
+        f(st.key(i), st.value(i));
+      }
+    };
+    each(slots, capacity);
+    if (migrating())
+      each(old, old_capacity);
+  }
   uint64_t memuse() const {
-    return sizeof(K) * keys.size() + sizeof(V) * values.size() +
-           sizeof(bool) * meta.size() + sizeof(size_t) * 3;
+    return slots.bytes() + old.bytes() + sizeof(size_t) * 5 +
+           sizeof(double);
+  }
+
+  // the table as a file, and a table over such a file with its slots still
+  // in it. see snapshot.hpp
+  void save(const char *path) const {
+    snapshot_header h = snapshot_header::of<K, V, storage>("linear", LF);
+    h.capacity = capacity;
+    h.old_capacity = old_capacity;
+    h.migrated = migrated;
+    h.size = sz;
+    h.effective_size = effective_size;
+    save_snapshot<K, V>(path, h, slots, old);
+  }
+  static linear open_mapped(const char *path,
+                            map_mode mode = map_mode::read_only) {
+    linear t;
+    auto expect = snapshot_header::of<K, V, storage>("linear", LF);
+    snapshot_header h = open_snapshot<K, V>(path, mode, expect, t.slots, t.old);
+    t.capacity = h.capacity;
+    t.old_capacity = h.old_capacity;
+    t.migrated = h.migrated;
+    t.sz = h.size;
+    t.effective_size = h.effective_size;
+    check_snapshot(t, t.slots, t.capacity);
+    return t;
+  }
+
+  // see stats.hpp. a key's displacement is how far past its home slot a
+  // lookup has to go, tombstones included
+  table_stats stats() const {
+    table_stats s;
+    auto scan = [&s](const storage &st, size_t cap) {
+      scan_slots(s, st, cap, [&](size_t i) {
+        size_t len;
+        probe(st, cap, st.key(i), st.key(i).hash(), len);
+        return len;
+      });
+    };
+    scan(slots, capacity);
+    if (migrating())
+      scan(old, old_capacity);
+    counters.fill(s);
+    return s;
   }
 
 private:
+  // old slots moved per put/erase. the new array can't reach the load
+  // factor again before `old` is drained as long as this is above 1/LF
+  static constexpr size_t resize_step = 64;
+
+  // the slot holding k, or the empty slot its probe ends on. `len` is how
+  // many slots it looked at
+  template <class Q>
+  static size_t probe(const storage &s, size_t cap, const Q &k, size_t hash,
+                      size_t &len) {
+    return linear_probe(s, cap - 1, k, hash, len);
+  }
+  template <class Q>
+  static size_t probe(const storage &s, size_t cap, const Q &k, size_t hash) {
+    size_t len;
+    return probe(s, cap, k, hash, len);
+  }
+
+  // to between a quarter and half full at the load factor
+  void shrink() {
+    size_t n = size_t(2 * sz / LF) + 1;
+    n = std::bit_ceil(std::max(n, size_t(16)));
+    if (n < capacity) {
+      rehash(n);
+      release_cached<Alloc>();
+    }
+  }
+
+  bool migrating() const { return Incremental && old_capacity; }
+
+  void grow() {
+    if constexpr (Incremental) {
+      // the last migration has to finish before `old` can be reused
+      while (migrating()) {
+        migrate_step();
+      }
+      counters.resized();
+      old = std::move(slots);
+      old_capacity = capacity;
+      migrated = 0;
+      capacity *= 2;
+      slots = storage(capacity);
+      effective_size = 0;
+    } else {
+      rehash(2 * capacity);
+    }
+  }
+
+  void migrate_step() {
+    [[maybe_unused]] auto timer = counters.time_resize();
+    size_t end = std::min(migrated + resize_step, old_capacity);
+    for (size_t i = old.next_occupied(migrated); i < end;
+         i = old.next_occupied(i + 1)) {
+      // keys in `old` are never in the new array. copied, since probes in
+      // `old` still compare against the key left in the tombstone
+      insert_unique(K(old.key(i)), V(old.value(i)));
+      old.set_tombstone(i);
+    }
+    migrated = end;
+    if (migrated == old_capacity) {
+      old = storage();
+      old_capacity = 0;
+    }
+  }
+
+  void remove(size_t h) {
+    linear_erase(slots, capacity - 1, h);
+    effective_size--;
+  }
+
+  // no duplicate check and no growth, for keys known to be absent
+  void insert_unique(K &&k, V &&v) {
+    size_t h = linear_free_slot(slots, capacity - 1, k.hash());
+    slots.set_occupied(h);
+    slots.key(h) = std::move(k);
+    slots.value(h) = std::move(v);
+    effective_size++;
+  }
+
   size_t sz = 0;
   size_t effective_size = 0;
   size_t capacity;
-  std::vector<K> keys;
-  std::vector<V> values;
-  std::vector<bool> meta;
+  storage slots;
+  storage old;
+  size_t old_capacity = 0; // nonzero while migrating out of `old`
+  size_t migrated = 0;     // old slots below this have been moved
+  double low_water = 0;
+  [[no_unique_address]] stats_counters counters;
 };
 } // namespace crash
 
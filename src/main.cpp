@@ -1,13 +1,10 @@
 #include "crash.hpp"
-#include "crash_multi.hpp"
 
 #include <chrono>
 #include <cstring>
 #include <iostream>
 #include <random>
-#include <thread>
 
-#include <set>
 using namespace std;
 using namespace crash;
 
@@ -66,78 +63,4 @@ int main() {
     t = t1 - t0;
     cout << t.count() << "s please " << cnt << "\n";
   }
-
-  exit(0);
-  auto t0 = Clock::now();
-  {
-    concurrent_hashtable<string_wrapper<_hash>, int> x(1 << 25);
-
-    vector<thread> threads;
-#define NUM_THREADS 6
-    for (int i = 0; i < NUM_THREADS; i++) {
-      threads.push_back(thread([&x, i, &keys]() {
-        thread_local pcg32 rng(i, i);
-        for (int j = 0; j < 5; j++)
-          rng.get();
-
-        for (int j = 0; j < NUM_OPS / NUM_THREADS; j++) {
-          // get an op
-          double op = (rng.get() * 0.5 / RAND_MAX);
-          int r = rng.get() % NUM_KEYS;
-
-          if (op < 0.8) {
-            x.get(keys[r]);
-          } else if (op < 0.95) {
-            // zz.insert(keys[r].s);
-            x.put(keys[r], 0);
-          } else {
-            x.erase(keys[r]);
-            // zz.erase(keys[r].s);00000
-          }
-        }
-      }));
-    }
-    for (auto &z : threads) {
-      z.join();
-    }
-  }
-  auto t1 = Clock::now();
-  std::chrono::duration<float> t = t1 - t0;
-  cout << t.count() << "s\n";
-
-  t0 = Clock::now();
-  {
-    concurrent_hashtable<string_wrapper<_hash>, int> x(1 << 25);
-
-    vector<thread> threads;
-    threads.push_back(thread([&x, &keys]() {
-      pcg32 rng(0, 0);
-      for (int j = 0; j < 5; j++)
-        rng.get();
-
-      for (int j = 0; j < NUM_OPS; j++) {
-        // get an op
-        double op = (rng.get() * 0.5 / RAND_MAX);
-        int r = rng.get() % NUM_KEYS;
-
-        if (op < 0.8) {
-          x.get(keys[r]);
-        } else if (op < 0.95) {
-          // zz.insert(keys[r].s);
-          x.put(keys[r], 0);
-        } else {
-          x.erase(keys[r]);
-          // zz.erase(keys[r].s);
-        }
-      }
-    }));
-    for (auto &z : threads) {
-      z.join();
-    }
-  }
-  t1 = Clock::now();
-  t = t1 - t0;
-  cout << t.count() << "s\n";
-
-  // x.dump();
 }
@@ -0,0 +1,398 @@
+#pragma once
+
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "alloc.hpp"
+#include "common.hpp"
+#include "crash_multi.hpp"
+
+namespace crash {
+
+// placing concurrent tables on the nodes of a multi socket machine. a table
+// built by one thread otherwise ends up on that thread's node, and every
+// lookup from another socket pays for remote memory. three ways out:
+//
+//   concurrent_hashtable<K, V, numa_allocator<K>>
+//     the slots spread page by page over every node, so each socket sees
+//     the same mix of local and remote misses and no one node's memory
+//     bandwidth is the bottleneck
+//   numa_sharded<K, V>
+//     a table per node, keys go to one by hash. each shard stays on its
+//     node through resizes, and a caller that sends work for a key to
+//     node_of(key) only ever touches local memory
+//   numa_replicated<K, V>
+//     a whole copy per node, every get is local. writes go through one log
+//     that each copy replays before it's read, so for read mostly maps
+//
+// placement is mbind(2) straight through the syscall, so there's nothing to
+// link. with one node, or without mbind, it all still works, the memory
+// just goes wherever the kernel puts it
+
+// the node ids there are, 1 if the machine doesn't say
+inline size_t numa_nodes() {
+  static const size_t nodes = [] {
+    size_t n = 1;
+#if defined(__linux__)
+    // e.g. "0-1" or "0,2-3"
+    std::ifstream f("/sys/devices/system/node/online");
+    std::string list;
+    if (f >> list) {
+      size_t x = 0;
+      for (char c : list) {
+        if (c >= '0' && c <= '9') {
+          x = x * 10 + (c - '0');
+        } else {
+          n = std::max(n, x + 1);
+          x = 0;
+        }
+      }
+      n = std::max(n, x + 1);
+    }
+#endif
+    return n;
+  }();
+  return nodes;
+}
+
+// lookups between checking which node the calling thread is on again
+constexpr unsigned numa_recheck_every = 1024;
+
+// the node the calling thread runs on. cached, a thread that moves sockets
+// is noticed within numa_recheck_every calls
+inline size_t numa_node() {
+  static thread_local size_t node = 0;
+  static thread_local unsigned calls = 0;
+  if (calls++ % numa_recheck_every == 0) {
+#if defined(__linux__)
+    unsigned cpu, n;
+    if (syscall(SYS_getcpu, &cpu, &n, nullptr) == 0)
+      node = std::min<size_t>(n, numa_nodes() - 1);
+#endif
+  }
+  return node;
+}
+
+// where numa_allocator puts an array: on every node in turn, or on one
+constexpr int numa_interleave = -1;
+
+// asks for [p, p + len) to go on `node`, or over every node for
+// numa_interleave. pages already touched stay where they are, so this goes
+// before anything is written. only a hint, failures are ignored
+inline void numa_place(void *p, size_t len, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+  size_t nodes = numa_nodes();
+  if (nodes == 1)
+    return;
+  constexpr size_t word_bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask((nodes + word_bits - 1) / word_bits);
+  for (size_t n = 0; n < nodes; n++) {
+    if (node == numa_interleave || n == size_t(node))
+      mask[n / word_bits] |= 1ul << n % word_bits;
+  }
+  // preferred rather than bind, a full node spills over instead of failing
+  int mode = node == numa_interleave ? MPOL_INTERLEAVE : MPOL_PREFERRED;
+  // the kernel wants one more than the highest bit
+  syscall(SYS_mbind, p, len, mode, mask.data(), nodes + 1, 0);
+#else
+  (void)p, (void)len, (void)node;
+#endif
+}
+
+// slot arrays placed by numa_place. anything under a page is left to
+// operator new, it can't be placed on its own. big arrays are mapped the
+// way slab_pool maps them, the rest a page at a time. nothing is cached, a
+// freed array could be on the wrong node for the next one
+template <class T> struct numa_allocator {
+  using value_type = T;
+
+  numa_allocator() = default;
+  explicit numa_allocator(int node) : node(node) {}
+  template <class U>
+  numa_allocator(const numa_allocator<U> &o) : node(o.node) {}
+
+  T *allocate(size_t n) {
+    size_t bytes = n * sizeof(T);
+    if (bytes < page_size)
+      return static_cast<T *>(::operator new(bytes, std::align_val_t(64)));
+    void *p;
+    size_t len = mapped(bytes);
+    if (bytes >= slab_pool::huge_page_threshold) {
+      p = slab_pool::map_huge(len);
+    } else {
+#if defined(__linux__)
+      p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+        throw std::bad_alloc();
+#else
+      return static_cast<T *>(::operator new(bytes, std::align_val_t(64)));
+#endif
+    }
+    numa_place(p, len, node);
+    return static_cast<T *>(p);
+  }
+  void deallocate(T *p, size_t n) {
+    size_t bytes = n * sizeof(T);
+    if (bytes >= slab_pool::huge_page_threshold) {
+      slab_pool::unmap_huge(p, mapped(bytes));
+      return;
+    }
+#if defined(__linux__)
+    if (bytes >= page_size) {
+      munmap(p, mapped(bytes));
+      return;
+    }
+#endif
+    ::operator delete(p, std::align_val_t(64));
+  }
+
+  template <class U> void construct(U *p) { ::new (static_cast<void *>(p)) U; }
+  template <class U, class... Args> void construct(U *p, Args &&...args) {
+    ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+  }
+
+  template <class U> bool operator==(const numa_allocator<U> &o) const {
+    return node == o.node;
+  }
+
+  int node = numa_interleave;
+
+private:
+  static constexpr size_t page_size = 4096;
+
+  static size_t mapped(size_t bytes) {
+    if (bytes >= slab_pool::huge_page_threshold)
+      return slab_pool::round_up(bytes);
+    return (bytes + page_size - 1) & ~(page_size - 1);
+  }
+};
+
+// the table of the node a key belongs to, for spreading work by key. the
+// top bits of the hash, the tables index with the low ones
+inline size_t numa_shard_index(size_t hash, size_t shards) {
+  return size_t((unsigned __int128)(hash * 0x9E3779B97F4A7C15ULL) * shards >>
+                64);
+}
+
+// one concurrent_hashtable per node, each with its slots on that node, and
+// keys split between them by hash. a get from a thread on another node is
+// still remote. what sharding buys is that no node holds the whole table,
+// and callers that route by node_of() get local memory for their own keys
+template <class Key, class Value>
+  requires Hashable<Key>
+class numa_sharded {
+public:
+  using K = Key;
+  using V = Value;
+  using engine = concurrent_hashtable<K, V, numa_allocator<K>>;
+
+  numa_sharded(size_t size = 16) {
+    size_t nodes = numa_nodes();
+    for (size_t n = 0; n < nodes; n++) {
+      shards.push_back(std::make_unique<engine>(
+          std::max<size_t>(size / nodes, 16), numa_allocator<K>(int(n))));
+    }
+  }
+  numa_sharded(const numa_sharded &) = delete;
+  numa_sharded &operator=(const numa_sharded &) = delete;
+
+  // the node `key`'s shard is on
+  size_t node_of(const K &key) const {
+    return numa_shard_index(key.hash(), shards.size());
+  }
+
+  std::optional<V> get(const K &key) const { return get(key, key.hash()); }
+  std::optional<V> get(const K &key, size_t hash) const {
+    return shard_for(hash).get(key, hash);
+  }
+  void put(const K &key, V v) { put(key, std::move(v), key.hash()); }
+  void put(const K &key, V v, size_t hash) {
+    shard_for(hash).put(key, std::move(v), hash);
+  }
+  bool erase(const K &key) { return shard_for(key.hash()).erase(key); }
+
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    for (size_t i = 0; i < ks.size(); i++) {
+      out[i] = get(ks[i]);
+    }
+  }
+  void put_batch(std::span<const K> ks, std::span<const V> vs) {
+    for (size_t i = 0; i < ks.size(); i++) {
+      put(ks[i], vs[i]);
+    }
+  }
+
+  // not a snapshot, shards are read one at a time
+  size_t size() const {
+    size_t n = 0;
+    for (auto &s : shards) {
+      n += s->size();
+    }
+    return n;
+  }
+  size_t capacity() const {
+    size_t n = 0;
+    for (auto &s : shards) {
+      n += s->capacity();
+    }
+    return n;
+  }
+
+private:
+  engine &shard_for(size_t hash) const {
+    return *shards[numa_shard_index(hash, shards.size())];
+  }
+
+  std::vector<std::unique_ptr<engine>> shards;
+};
+
+// a full copy of the map on every node, so gets only ever read local
+// memory. writers take turns appending to one log of puts and erases, and
+// each copy replays the log up to its end before it's read: a get sees
+// every write that finished before it started, the same as one table.
+// the writer also replays its own node's copy, so readers there rarely
+// have to.
+//
+// a get that's already caught up reads two lines no one writes to unless
+// there's a write, the log's end and its copy's position. writes are
+// serialized, and one that finds the log `Log` entries ahead of a copy
+// first replays that copy itself. so this is for maps that are read far
+// more than they're written
+template <class Key, class Value, size_t Log = 4096>
+  requires Hashable<Key> && (std::has_single_bit(Log))
+class numa_replicated {
+public:
+  using K = Key;
+  using V = Value;
+  using engine = concurrent_hashtable<K, V, numa_allocator<K>>;
+
+  numa_replicated(size_t size = 16) : log(new entry[Log]) {
+    for (size_t n = 0; n < numa_nodes(); n++) {
+      replicas.push_back(std::make_unique<replica>(size, int(n)));
+    }
+  }
+  numa_replicated(const numa_replicated &) = delete;
+  numa_replicated &operator=(const numa_replicated &) = delete;
+
+  std::optional<V> get(const K &key) const { return get(key, key.hash()); }
+  std::optional<V> get(const K &key, size_t hash) const {
+    replica &r = local();
+    catch_up(r);
+    return r.table.get(key, hash);
+  }
+
+  void put(const K &key, V v) { append(key, std::move(v), false); }
+  // false if `key` wasn't there
+  bool erase(const K &key) {
+    std::lock_guard l(write_lock);
+    replica &r = local();
+    catch_up(r);
+    // writes are serialized, so nothing can change this before the append
+    if (!r.table.get(key))
+      return false;
+    append_locked(key, V(), true);
+    return true;
+  }
+
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    replica &r = local();
+    catch_up(r);
+    r.table.get_batch(ks, out);
+  }
+  void put_batch(std::span<const K> ks, std::span<const V> vs) {
+    for (size_t i = 0; i < ks.size(); i++) {
+      put(ks[i], vs[i]);
+    }
+  }
+
+  size_t size() const {
+    replica &r = local();
+    catch_up(r);
+    return r.table.size();
+  }
+  // of one copy, there are numa_nodes() of them
+  size_t capacity() const { return local().table.capacity(); }
+
+private:
+  struct entry {
+    K key;
+    V value;
+    bool erase = false;
+  };
+
+  struct alignas(64) replica {
+    replica(size_t size, int node) : table(size, numa_allocator<K>(node)) {}
+    // log entries before this are in `table`
+    std::atomic<uint64_t> applied = 0;
+    std::mutex lock; // held while replaying
+    engine table;
+  };
+
+  replica &local() const {
+    return *replicas[std::min(numa_node(), replicas.size() - 1)];
+  }
+
+  void append(const K &key, V v, bool erase) {
+    std::lock_guard l(write_lock);
+    append_locked(key, std::move(v), erase);
+  }
+  void append_locked(const K &key, V v, bool erase) {
+    uint64_t t = end.load(std::memory_order_relaxed);
+    // the entry about to be overwritten has to be in every copy
+    for (auto &r : replicas) {
+      if (t - r->applied.load(std::memory_order_acquire) >= Log)
+        catch_up(*r);
+    }
+    log[t & (Log - 1)] = {key, std::move(v), erase};
+    end.store(t + 1, std::memory_order_release);
+    catch_up(local());
+  }
+
+  // replays the log into `r` up to where it ends now
+  void catch_up(replica &r) const {
+    uint64_t t = end.load(std::memory_order_acquire);
+    if (r.applied.load(std::memory_order_acquire) >= t)
+      return;
+    std::lock_guard l(r.lock);
+    for (uint64_t i = r.applied.load(std::memory_order_relaxed); i < t; i++) {
+      const entry &e = log[i & (Log - 1)];
+      if (e.erase)
+        r.table.erase(e.key);
+      else
+        r.table.put(e.key, e.value);
+      r.applied.store(i + 1, std::memory_order_release);
+    }
+  }
+
+  std::vector<std::unique_ptr<replica>> replicas;
+  std::unique_ptr<entry[]> log;
+  std::mutex write_lock;
+  // entries appended so far, on a line of its own: every get reads it
+  alignas(64) std::atomic<uint64_t> end = 0;
+};
+
+} // namespace crash
+
+#endif
@@ -0,0 +1,229 @@
+#pragma once
+
+#ifndef PERFECT_HPP
+#define PERFECT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "alloc.hpp"
+#include "common.hpp"
+#include "hash.hpp"
+
+namespace crash {
+
+// a read-only table over a fixed key set, built once with a minimal perfect
+// hash (PTHash style), so every key has a slot of its own, the n keys fill
+// exactly n slots, and a lookup is a single probe with no metadata.
+//
+// keys are split into buckets of about `bucket_keys` by their hash. the
+// biggest buckets go first, and each gets the first `pilot` that sends all
+// of its keys to free slots of a table slightly bigger than n. the few
+// slots past n are then remapped onto the holes left below it. a lookup
+// reads the bucket's pilot and then the one slot it points to.
+//
+// keys must have distinct hash() values, no pilot can split two keys that
+// hash the same. building throws std::invalid_argument if any do
+template <class Key, class Value, class Alloc = slab_allocator<Key>>
+  requires Hashable<Key>
+class perfect_table {
+public:
+  using K = Key;
+  using V = Value;
+
+  perfect_table() = default;
+  perfect_table(std::span<const K> keys, std::span<const V> values) {
+    build(keys, values);
+  }
+  // every key and value of a finished table, e.g. a linear or robinhood
+  template <class Engine>
+    requires requires(const Engine &t) {
+      t.for_each([](const K &, const V &) {});
+    }
+  explicit perfect_table(const Engine &t) {
+    std::vector<K> keys;
+    std::vector<V> values;
+    keys.reserve(t.size());
+    values.reserve(t.size());
+    t.for_each([&](const K &k, const V &v) {
+      keys.push_back(k);
+      values.push_back(v);
+    });
+    build(keys, values);
+  }
+
+  std::optional<V> get(const K &k) const { return get(k, k.hash()); }
+  template <Lookup<K> Q> std::optional<V> get(const Q &q) const {
+    return get(q, K::hash_of(q));
+  }
+  template <class Q> std::optional<V> get(const Q &k, size_t hash) const {
+    if (entries.empty())
+      return {};
+    const entry &e = entries[slot(hash)];
+    if (e.key == k)
+      return e.value;
+    return {};
+  }
+
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    if (entries.empty()) {
+      std::fill(out.begin(), out.end(), std::nullopt);
+      return;
+    }
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { prefetch_read(&pilots[bucket(mix(h))]); },
+        [&](size_t i, size_t h) { out[i] = get(ks[i], h); });
+  }
+
+  size_t size() const { return entries.size(); }
+  uint64_t memuse() const {
+    return sizeof(entry) * entries.capacity() +
+           sizeof(pilot) * pilots.capacity() +
+           sizeof(size_t) * remap.capacity() + sizeof(size_t) * 2;
+  }
+
+private:
+  // average keys per bucket, and how full the table the pilots are
+  // searched over is. more of either means fewer pilots but longer builds
+  static constexpr size_t bucket_keys = 4;
+  static constexpr double fill = 0.98;
+
+  // half a byte per key, so they stay in cache better than the entries.
+  // pilots in practice stay below a few thousand
+  using pilot = uint16_t;
+
+  struct entry {
+    K key;
+    V value;
+  };
+
+  // a strong mix of the key's own hash, which may be weak (std::hash on
+  // integers is the identity). buckets and slots are both picked from it
+  size_t mix(size_t hash) const { return wy::mix(hash ^ seed, wy::p1); }
+  // which of `n` by the high bits, without a division
+  static size_t range(size_t h, size_t n) {
+    return (__uint128_t(h) * n) >> 64;
+  }
+  size_t bucket(size_t h) const { return range(h, pilots.size()); }
+  size_t position(size_t h, size_t p) const {
+    return range(wy::mix(h ^ (p * 0x9E3779B97F4A7C15ULL), wy::p2),
+                 table_size);
+  }
+  size_t slot(size_t hash) const {
+    size_t h = mix(hash);
+    size_t pos = position(h, pilots[bucket(h)]);
+    return pos < entries.size() ? pos : remap[pos - entries.size()];
+  }
+
+  void build(std::span<const K> keys, std::span<const V> values) {
+    size_t n = keys.size();
+    if (!n)
+      return;
+    table_size = std::max(n, size_t(n / fill));
+    pilots.resize((n + bucket_keys - 1) / bucket_keys);
+    remap.assign(table_size - n, 0);
+    // a pilot that doesn't fit means a hopeless bucket, start over with
+    // every key in a different one
+    while (!search(keys)) {
+      seed = wy::mix(seed, wy::p3);
+    }
+    entries = alloc_vector<entry, Alloc>(n);
+    for (size_t i = 0; i < n; i++) {
+      entries[slot(keys[i].hash())] = {keys[i], values[i]};
+    }
+  }
+
+  // pilots for every bucket and the remap, false if some bucket needs a
+  // pilot past what fits in one
+  bool search(std::span<const K> keys) {
+    size_t n = keys.size(), buckets = pilots.size();
+    // (bucket, hash) of every key, sorted so a bucket's keys sit together
+    // and equal hashes end up next to each other
+    std::vector<std::pair<size_t, size_t>> hs(n);
+    for (size_t i = 0; i < n; i++) {
+      size_t h = mix(keys[i].hash());
+      hs[i] = {bucket(h), h};
+    }
+    std::sort(hs.begin(), hs.end());
+    if (std::adjacent_find(hs.begin(), hs.end()) != hs.end())
+      throw std::invalid_argument("perfect_table: keys with equal hashes");
+
+    std::vector<size_t> start(buckets + 1, 0);
+    for (auto [b, h] : hs) {
+      start[b + 1]++;
+    }
+    size_t biggest = 0;
+    for (size_t b = 0; b < buckets; b++) {
+      biggest = std::max(biggest, start[b + 1]);
+      start[b + 1] += start[b];
+    }
+    // biggest buckets first, while there's the most room. counting sort,
+    // empty ones last
+    std::vector<size_t> order(buckets), at(biggest + 1, 0);
+    auto keys_in = [&](size_t b) { return start[b + 1] - start[b]; };
+    for (size_t b = 0; b < buckets; b++) {
+      at[keys_in(b)]++;
+    }
+    for (size_t k = biggest + 1, sum = 0; k-- > 0;) {
+      sum += std::exchange(at[k], sum);
+    }
+    for (size_t b = 0; b < buckets; b++) {
+      order[at[keys_in(b)]++] = b;
+    }
+
+    std::vector<bool> taken(table_size);
+    std::vector<size_t> pos;
+    for (size_t b : order) {
+      size_t first = start[b], last = start[b + 1];
+      if (first == last)
+        break;
+      for (size_t p = 0;; p++) {
+        if (p > std::numeric_limits<pilot>::max())
+          return false;
+        pos.clear();
+        size_t j = first;
+        for (; j < last; j++) {
+          size_t x = position(hs[j].second, p);
+          if (taken[x] || std::find(pos.begin(), pos.end(), x) != pos.end())
+            break;
+          pos.push_back(x);
+        }
+        if (j == last) {
+          for (size_t x : pos) {
+            taken[x] = true;
+          }
+          pilots[b] = p;
+          break;
+        }
+      }
+    }
+
+    // the slots past n that got used, onto the holes below n in order
+    for (size_t hole = 0, x = n; x < table_size; x++) {
+      if (!taken[x])
+        continue;
+      while (taken[hole]) {
+        hole++;
+      }
+      remap[x - n] = hole++;
+    }
+    return true;
+  }
+
+  alloc_vector<entry, Alloc> entries;
+  std::vector<pilot> pilots;
+  std::vector<size_t> remap; // slot for each position at or past n
+  size_t table_size = 0;     // positions pilots pick from
+  size_t seed = wy::p0;
+};
+
+} // namespace crash
+
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+#ifndef PROBE_HPP
+#define PROBE_HPP
+
+#include <cstddef>
+#include <utility>
+
+namespace crash {
+
+// the linear probing loops, shared by linear and static_table. `S` is
+// anything with a layout storage's interface (used, occupied, key, value,
+// set_occupied, set_empty), `mask` is its slot count - 1. constexpr so a
+// static_table can run them at compile time
+
+// the slot holding k, or the empty slot its probe ends on. `len` is how many
+// slots it looked at
+template <class S, class Q>
+constexpr size_t linear_probe(const S &s, size_t mask, const Q &k,
+                              size_t hash, size_t &len) {
+  size_t h = hash & mask;
+  len = 1;
+  while (s.used(h) && (k != s.key(h))) {
+    h = (h + 1) & mask;
+    len++;
+  }
+  return h;
+}
+
+// where a key known to be absent goes
+template <class S>
+constexpr size_t linear_free_slot(const S &s, size_t mask, size_t hash) {
+  size_t h = hash & mask;
+  while (s.used(h)) {
+    h = (h + 1) & mask;
+  }
+  return h;
+}
+
+// empty slot h, then move back every key after it in the cluster whose
+// probe passes h on the way to where it is now. leaves no tombstone, but
+// only works on arrays that don't have any
+template <class S> constexpr void linear_erase(S &s, size_t mask, size_t h) {
+  s.set_empty(h);
+  for (size_t i = (h + 1) & mask; s.occupied(i); i = (i + 1) & mask) {
+    size_t home = s.key(i).hash() & mask;
+    if (((i - home) & mask) >= ((i - h) & mask)) {
+      s.key(h) = std::move(s.key(i));
+      s.value(h) = std::move(s.value(i));
+      s.set_occupied(h);
+      s.set_empty(i);
+      h = i;
+    }
+  }
+}
+
+} // namespace crash
+
+#endif
@@ -3,122 +3,440 @@
 #ifndef QUADRATIC_HPP
 #define QUADRATIC_HPP
 
+#include <algorithm>
+#include <bit>
 #include <cstring>
 #include <functional>
 #include <optional>
+#include <utility>
 #include <vector>
 
 #include <iostream>
 #include <set>
+#include <span>
 #include <string>
 
+#include "bulk.hpp"
 #include "common.hpp"
+#include "layout.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
 
 namespace crash {
 
-template <class Key, class Value, int LoadFactor>
+// `Incremental` grows the same way linear does, see linear.hpp
+template <class Key, class Value, int LoadFactor, class Layout = soa<>,
+          bool Incremental = false, class Alloc = slab_allocator<Key>>
   requires Hashable<Key>
 class quadratic {
+  using storage = typename Layout::template storage<Key, Value, Alloc>;
+
 public:
   using K = Key;
   using V = Value;
-  double LF = LoadFactor / 100.0;
+  static constexpr double LF = LoadFactor / 100.0;
 
-  quadratic(size_t size_ = 16)
-      : capacity(size_), keys(size_), values(size_), meta(2 * size_) {}
+  quadratic(size_t size_ = 16) : capacity(size_), slots(size_) {}
 
-  std::optional<V> get(const K &k) const {
-    size_t h = k.hash() & (capacity - 1); // save might save an instruction
-    size_t i = 1;
-    bool res;
-    for (i = 1, res = false;
-         (meta[2 * h] || meta[2 * h + 1]) && (res = (k != keys[h]));) {
-      h = (h + i) & (capacity - 1);
-      i++;
+  std::optional<V> get(const K &k) const { return get(k, k.hash()); }
+  // by anything a key compares equal to, e.g. a string_view for string_key,
+  // without building a key first
+  template <Lookup<K> Q> std::optional<V> get(const Q &q) const {
+    return get(q, K::hash_of(q));
+  }
+
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { slots.prefetch(h & (capacity - 1)); },
+        [&](size_t i, size_t h) { out[i] = get(ks[i], h); });
+  }
+
+  template <class Q> std::optional<V> get(const Q &k, size_t hash) const {
+    size_t len, old_len = 0;
+    size_t h = probe(slots, capacity, k, hash, len);
+    if (slots.occupied(h)) {
+      counters.hit(len);
+      return slots.value(h);
     }
-    if (meta[2 * h]) {
-      return values[h];
+    if (migrating()) {
+      h = probe(old, old_capacity, k, hash, old_len);
+      if (old.occupied(h)) {
+        counters.hit(len + old_len);
+        return old.value(h);
+      }
     }
+    counters.miss(len + old_len);
     return {};
   }
   V find(const K &k) const {
-
-    size_t h = k.hash() & (capacity - 1);
-    size_t i = 1;
-    for (i = 1; (meta[2 * h] || meta[2 * h + 1]) && (k != keys[h]);) {
-      h = (h + i) & (capacity - 1);
-      i++;
+    size_t h = probe(slots, capacity, k, k.hash());
+    if (!slots.occupied(h) && migrating()) {
+      size_t o = probe(old, old_capacity, k, k.hash());
+      if (old.occupied(o))
+        return old.value(o);
     }
-    return values[h];
+    return slots.value(h);
   }
 
-  void put(const K &k, V v) {
+  void put(const K &k, V v) { put(k, v, k.hash()); }
 
-    size_t h = k.hash() & (capacity - 1);
-    size_t i = 1;
-    for (; (meta[2 * h] || meta[2 * h + 1]) && (k != keys[h]);) {
-      h = (h + i) & (capacity - 1);
-      i++;
-    }
-    if (meta[2 * h]) {
-      values[h] = v;
+  void put_batch(std::span<const K> ks, std::span<const V> vs) {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { slots.prefetch(h & (capacity - 1)); },
+        [&](size_t i, size_t h) { put(ks[i], vs[i], h); });
+  }
+
+  void put(const K &k, V v, size_t hash) {
+    if (migrating())
+      migrate_step();
+    size_t h = probe_insert(k, hash);
+    if (slots.occupied(h)) {
+      slots.value(h) = v;
       return;
     }
+    if (migrating()) {
+      size_t o = probe(old, old_capacity, k, hash);
+      if (old.occupied(o)) {
+        old.set_tombstone(o);
+        _size--;
+      }
+    }
 
     _size++;
-    effective_size++;
+    if (slots.tombstone(h))
+      tombstones--;
+    else
+      effective_size++;
     // do i resize? yes
-    meta[2 * h] = true;
-    meta[2 * h + 1] = false;
-    keys[h] = k;
-    values[h] = v;
+    slots.set_occupied(h);
+    slots.key(h) = k;
+    slots.value(h) = v;
 
     if (effective_size >= capacity * LF) {
-      // resize
+      // churn rather than growth. dropping the tombstones frees at least a
+      // quarter of the load factor, so this can't come right back
+      if (4 * tombstones >= effective_size)
+        compact();
+      else
+        grow();
+    }
+  }
+  void erase(const K &k) {
+    if (migrating())
+      migrate_step();
+    size_t h = probe(slots, capacity, k, k.hash());
+    if (slots.occupied(h)) {
+      _size--;
+      tombstones++;
+      slots.set_tombstone(h);
+    } else if (migrating()) {
+      h = probe(old, old_capacity, k, k.hash());
+      if (old.occupied(h)) {
+        _size--;
+        old.set_tombstone(h);
+      }
+    }
+    if (_size < capacity * LF * low_water)
+      shrink();
+  }
+  // room for n keys before the next resize
+  void reserve(size_t n) { rehash(size_t(n / LF) + 1); }
 
-      quadratic replacement(2 * capacity);
-      for (int i = 0; i < capacity; i++) {
-        if (meta[2 * i]) {
-          replacement.put(keys[i], values[i]);
-        }
+  // put every keys[i], values[i], the same as that many puts would. into an
+  // empty table it's a parallel build on `threads` threads (0 is one per
+  // core), see bulk.hpp. into one that isn't, a reserve and then the puts
+  void bulk_load(std::span<const K> keys, std::span<const V> values,
+                 size_t threads = 0) {
+    if (_size) {
+      reserve(_size + keys.size());
+      for (size_t i = 0; i < keys.size(); i++) {
+        put(keys[i], values[i]);
       }
-      std::swap(*this, replacement);
+      return;
+    }
+    size_t n = size_t(keys.size() / LF) + 1;
+    n = std::bit_ceil(std::max({n, capacity, size_t(16)}));
+    slots = storage(n);
+    capacity = n;
+    old = storage();
+    old_capacity = 0;
+    tombstones = 0;
+    std::vector<size_t> spill;
+    _size = effective_size = bulk_fill(
+        slots, n, keys, values, threads, spill,
+        // the triangular probe, as long as it stays in the slice
+        [](const storage &s, size_t home, size_t, size_t end) {
+          size_t h = home;
+          for (size_t i = 1; h < end && s.used(h); i++) {
+            h += i;
+          }
+          return h;
+        });
+    for (size_t i : spill) {
+      put(keys[i], values[i]);
     }
   }
-  void erase(const K &k) {
 
-    size_t h = k.hash() & (capacity - 1);
-    size_t i = 1;
-    bool res;
-    for (i = 1, res = false;
-         (meta[2 * h] || meta[2 * h + 1]) && (res = (k != keys[h]));) {
-      h = (h + i) & (capacity - 1);
-      i++;
+  // rebuild with at least n slots, or as many as the current keys need
+  void rehash(size_t n) {
+    while (migrating()) {
+      migrate_step();
     }
-    if (res) {
-      _size--;
-      meta[2 * h] = false;
-      meta[2 * h + 1] = true;
+    [[maybe_unused]] auto timer = counters.time_resize();
+    counters.resized();
+    n = std::bit_ceil(std::max({n, size_t(_size / LF) + 1, size_t(16)}));
+    storage prev = std::exchange(slots, storage(n));
+    size_t prev_capacity = std::exchange(capacity, n);
+    effective_size = 0;
+    tombstones = 0;
+    for (size_t i = prev.next_occupied(0); i < prev_capacity;
+         i = prev.next_occupied(i + 1)) {
+      insert_unique(std::move(prev.key(i)), std::move(prev.value(i)));
     }
   }
+
+  // rebuild at the smallest capacity the keys fit in, and hand what that
+  // frees back to the system
+  void shrink_to_fit() {
+    rehash(0);
+    release_cached<Alloc>();
+  }
+
+  // once an erase takes size() below `fraction` of what capacity() holds at
+  // the load factor, the table is rebuilt at most half full at it. 0 (the
+  // default) never shrinks. capped at 1/8, so after a shrink the size has
+  // to double or halve again before the next resize either way
+  void set_low_water(double fraction) {
+    low_water = std::clamp(fraction, 0.0, 0.125);
+  }
+
   void clear() {
-    _size = effective_size = 0;
-    keys.clear();
-    values.clear();
-    meta.clear();
+    _size = effective_size = tombstones = 0;
+    slots.clear();
+    old = storage();
+    old_capacity = 0;
+  }
+  void prefetch(const K &k) const {
+    slots.prefetch(k.hash() & (capacity - 1));
   }
   size_t size() const { return _size; }
+
+  // f(key, value) for every key, in no particular order
+  template <class F> void for_each(F &&f) const {
+    auto each = [&f](const storage &st, size_t cap) {
+      for (size_t i = st.next_occupied(0); i < cap;
+           i = st.next_occupied(i + 1)) {
+        f(st.key(i), st.value(i));
+      }
+    };
+    each(slots, capacity);
+    if (migrating())
+      each(old, old_capacity);
+  }
   uint64_t memuse() const {
-    return keys.size() * sizeof(K) + values.size() * sizeof(V) + meta.size();
+    return slots.bytes() + old.bytes() + sizeof(size_t) * 6 +
+           sizeof(double);
+  }
+
+  // the table as a file, and a table over such a file with its slots still
+  // in it. see snapshot.hpp
+  void save(const char *path) const {
+    snapshot_header h = snapshot_header::of<K, V, storage>("quadratic", LF);
+    h.capacity = capacity;
+    h.old_capacity = old_capacity;
+    h.migrated = migrated;
+    h.size = _size;
+    h.effective_size = effective_size;
+    h.tombstones = tombstones;
+    save_snapshot<K, V>(path, h, slots, old);
+  }
+  static quadratic open_mapped(const char *path,
+                               map_mode mode = map_mode::read_only) {
+    quadratic t;
+    auto expect = snapshot_header::of<K, V, storage>("quadratic", LF);
+    snapshot_header h = open_snapshot<K, V>(path, mode, expect, t.slots, t.old);
+    t.capacity = h.capacity;
+    t.old_capacity = h.old_capacity;
+    t.migrated = h.migrated;
+    t._size = h.size;
+    t.effective_size = h.effective_size;
+    t.tombstones = h.tombstones;
+    check_snapshot(t, t.slots, t.capacity);
+    return t;
+  }
+
+  // see stats.hpp. a key's displacement is how many probe steps past its
+  // home slot it sits, not how many slots
+  table_stats stats() const {
+    table_stats s;
+    auto scan = [&s](const storage &st, size_t cap) {
+      scan_slots(s, st, cap, [&](size_t i) {
+        size_t len;
+        probe(st, cap, st.key(i), st.key(i).hash(), len);
+        return len;
+      });
+    };
+    scan(slots, capacity);
+    if (migrating())
+      scan(old, old_capacity);
+    counters.fill(s);
+    return s;
   }
 
 private:
+  static constexpr size_t resize_step = 64;
+
+  // triangular steps, the slot holding k or the empty slot the probe ends on
+  template <class Q>
+  static size_t probe(const storage &s, size_t cap, const Q &k, size_t hash,
+                      size_t &len) {
+    size_t h = hash & (cap - 1); // save might save an instruction
+    size_t i = 1;
+    for (; s.used(h) && (k != s.key(h)); i++) {
+      h = (h + i) & (cap - 1);
+    }
+    len = i;
+    return h;
+  }
+  template <class Q>
+  static size_t probe(const storage &s, size_t cap, const Q &k, size_t hash) {
+    size_t len;
+    return probe(s, cap, k, hash, len);
+  }
+
+  // to between a quarter and half full at the load factor
+  void shrink() {
+    size_t n = size_t(2 * _size / LF) + 1;
+    n = std::bit_ceil(std::max(n, size_t(16)));
+    if (n < capacity) {
+      rehash(n);
+      release_cached<Alloc>();
+    }
+  }
+
+  bool migrating() const { return Incremental && old_capacity; }
+
+  void grow() {
+    if constexpr (Incremental) {
+      while (migrating()) {
+        migrate_step();
+      }
+      counters.resized();
+      old = std::move(slots);
+      old_capacity = capacity;
+      migrated = 0;
+      capacity *= 2;
+      slots = storage(capacity);
+      effective_size = 0;
+      tombstones = 0;
+    } else {
+      rehash(2 * capacity);
+    }
+  }
+
+  void migrate_step() {
+    [[maybe_unused]] auto timer = counters.time_resize();
+    size_t end = std::min(migrated + resize_step, old_capacity);
+    for (size_t i = old.next_occupied(migrated); i < end;
+         i = old.next_occupied(i + 1)) {
+      // copied, probes in `old` still compare against the tombstone's key
+      insert_unique(K(old.key(i)), V(old.value(i)));
+      old.set_tombstone(i);
+    }
+    migrated = end;
+    if (migrated == old_capacity) {
+      old = storage();
+      old_capacity = 0;
+    }
+  }
+
+  // the slot holding k, or where it goes if it's absent: the first
+  // tombstone on the way, or the empty slot the probe ends on
+  size_t probe_insert(const K &k, size_t hash) const {
+    size_t mask = capacity - 1;
+    size_t h = hash & mask;
+    size_t free = capacity;
+    for (size_t i = 1; slots.used(h); i++) {
+      if (k == slots.key(h)) {
+        // k is never further along than a tombstone of its own
+        return slots.occupied(h) || free == capacity ? h : free;
+      }
+      if (free == capacity && slots.tombstone(h))
+        free = h;
+      h = (h + i) & mask;
+    }
+    return free == capacity ? h : free;
+  }
+
+  // no duplicate check and no growth, for keys known to be absent
+  void insert_unique(K &&k, V &&v) {
+    size_t h = k.hash() & (capacity - 1);
+    for (size_t i = 1; slots.occupied(h); i++) {
+      h = (h + i) & (capacity - 1);
+    }
+    if (slots.tombstone(h))
+      tombstones--;
+    else
+      effective_size++;
+    slots.set_occupied(h);
+    slots.key(h) = std::move(k);
+    slots.value(h) = std::move(v);
+  }
+
+  // a same capacity rehash that drops every tombstone without a second
+  // array, the way abseil does it. live keys are marked as tombstones and
+  // tombstones become empty, then each marked key goes to the first free
+  // slot of its probe sequence, trading places with a marked key if that's
+  // where it lands. every step settles one key for good
+  void compact() {
+    while (migrating()) {
+      migrate_step();
+    }
+    [[maybe_unused]] auto timer = counters.time_resize();
+    counters.resized();
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+      if (slots.occupied(i))
+        slots.set_tombstone(i);
+      else
+        slots.set_empty(i);
+    }
+    for (size_t i = 0; i < capacity; i++) {
+      while (slots.tombstone(i)) {
+        size_t h = slots.key(i).hash() & mask;
+        for (size_t j = 1; slots.occupied(h); j++) {
+          h = (h + j) & mask;
+        }
+        if (h == i) {
+          slots.set_occupied(i);
+        } else if (!slots.used(h)) {
+          slots.key(h) = std::move(slots.key(i));
+          slots.value(h) = std::move(slots.value(i));
+          slots.set_occupied(h);
+          slots.set_empty(i);
+        } else {
+          std::swap(slots.key(h), slots.key(i));
+          std::swap(slots.value(h), slots.value(i));
+          slots.set_occupied(h);
+        }
+      }
+    }
+    effective_size = _size;
+    tombstones = 0;
+  }
+
   size_t _size = 0;
-  size_t effective_size = 0;
+  size_t effective_size = 0; // occupied slots and tombstones in `slots`
+  size_t tombstones = 0;
   size_t capacity;
-  std::vector<K> keys;
-  std::vector<V> values;
-  std::vector<bool> meta;
+  storage slots;
+  storage old;
+  size_t old_capacity = 0; // nonzero while migrating out of `old`
+  size_t migrated = 0;     // old slots below this have been moved
+  double low_water = 0;
+  [[no_unique_address]] stats_counters counters;
 };
 } // namespace crash
 
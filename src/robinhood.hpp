@@ -3,81 +3,323 @@
 #ifndef ROBINHOOD_HPP
 #define ROBINHOOD_HPP
 
+#include "bulk.hpp"
 #include "common.hpp"
+#include "layout.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
 
+#include <algorithm>
+#include <bit>
 #include <iostream>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
 
 namespace crash {
 
-template <class Key, class Value, int LoadFactor>
+// `Incremental` grows like linear does (see linear.hpp), except that robin
+// hood has no tombstones: old slots are taken out with the same backward
+// shift erase uses, which keeps `old` a valid table while it drains
+template <class Key, class Value, int LoadFactor, class Layout = soa<>,
+          bool Incremental = false, class Alloc = slab_allocator<Key>>
   requires Hashable<Key>
 class robinhood {
+  using storage = typename Layout::template storage<Key, Value, Alloc>;
+
 public:
   using K = Key;
   using V = Value;
-  double LF = LoadFactor / 100.0;
+  static constexpr double LF = LoadFactor / 100.0;
 
-  robinhood(size_t size_ = 16)
-      : capacity(size_), keys(size_), values(size_), occupied(size_) {}
+  robinhood(size_t size_ = 16) : capacity(size_), slots(size_) {}
 
-  std::optional<V> get(const K &k) const {
-    int probe_length;
-    size_t h = k.hash() & (capacity - 1);
-    bool res;
-    for (probe_length = 0, res = false;
-         occupied[h] && (res = (k != keys[h]));) {
-      h = (h + 1) & (capacity - 1);
-      probe_length++;
+  std::optional<V> get(const K &k) const { return get(k, k.hash()); }
+  // by anything a key compares equal to, e.g. a string_view for string_key,
+  // without building a key first
+  template <Lookup<K> Q> std::optional<V> get(const Q &q) const {
+    return get(q, K::hash_of(q));
+  }
+
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { slots.prefetch(h & (capacity - 1)); },
+        [&](size_t i, size_t h) { out[i] = get(ks[i], h); });
+  }
+
+  template <class Q> std::optional<V> get(const Q &k, size_t hash) const {
+    size_t len, old_len = 0;
+    size_t h = probe(slots, capacity, k, hash, len);
+    if (slots.occupied(h)) {
+      counters.hit(len);
+      return slots.value(h);
     }
-    if (occupied[h])
-      return values[h];
+    if (migrating()) {
+      h = probe(old, old_capacity, k, hash, old_len);
+      if (old.occupied(h)) {
+        counters.hit(len + old_len);
+        return old.value(h);
+      }
+    }
+    counters.miss(len + old_len);
     return {};
   }
   V find(const K &k) const {
-    int probe_length;
-    size_t h = k.hash() & (capacity - 1);
-    for (probe_length = 0; occupied[h] && (k != keys[h]);) {
-      h = (h + 1) & (capacity - 1);
-      probe_length++;
+    size_t h = probe(slots, capacity, k, k.hash());
+    if (!slots.occupied(h) && migrating()) {
+      size_t o = probe(old, old_capacity, k, k.hash());
+      if (old.occupied(o))
+        return old.value(o);
     }
-    return values[h];
+    return slots.value(h);
+  }
+
+  void put(const K &k, V v) { put(k, v, k.hash()); }
+
+  void put_batch(std::span<const K> ks, std::span<const V> vs) {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { slots.prefetch(h & (capacity - 1)); },
+        [&](size_t i, size_t h) { put(ks[i], vs[i], h); });
   }
 
-  void put(const K &k_, V v) {
+  void put(const K &k, V v, size_t hash) {
     if (effective_size >= capacity * LF) {
-      // grow
-      robinhood<K, V, LoadFactor> new_table(capacity * 2);
-      for (int i = 0; i < capacity; i++) {
-        if (occupied[i]) {
-          new_table.put(keys[i], values[i]);
-        }
+      grow();
+    }
+    if (migrating())
+      migrate_step();
+    if (migrating()) {
+      size_t o = probe(old, old_capacity, k, hash);
+      if (old.occupied(o)) {
+        remove(old, old_capacity, o);
+        _size--;
       }
-      std::swap(new_table, *this);
     }
-    K k = k_;
+    if (place(k, v, hash)) {
+      _size++;
+      effective_size++;
+    }
+  }
+
+  void erase(const K &k) {
+    if (migrating())
+      migrate_step();
+    size_t h = probe(slots, capacity, k, k.hash());
+    if (slots.occupied(h)) {
+      remove(slots, capacity, h);
+      _size--;
+      effective_size--;
+    } else if (migrating()) {
+      h = probe(old, old_capacity, k, k.hash());
+      if (old.occupied(h)) {
+        remove(old, old_capacity, h);
+        _size--;
+      }
+    }
+    if (_size < capacity * LF * low_water)
+      shrink();
+  }
+  // room for n keys before the next resize
+  void reserve(size_t n) { rehash(size_t(n / LF) + 1); }
+
+  // put every keys[i], values[i], the same as that many puts would. into an
+  // empty table it's a parallel build on `threads` threads (0 is one per
+  // core), see bulk.hpp. into one that isn't, a reserve and then the puts
+  void bulk_load(std::span<const K> keys, std::span<const V> values,
+                 size_t threads = 0) {
+    if (_size) {
+      reserve(_size + keys.size());
+      for (size_t i = 0; i < keys.size(); i++) {
+        put(keys[i], values[i]);
+      }
+      return;
+    }
+    size_t n = size_t(keys.size() / LF) + 1;
+    n = std::bit_ceil(std::max({n, capacity, size_t(16)}));
+    slots = storage(n);
+    capacity = n;
+    old = storage();
+    old_capacity = 0;
+    std::vector<size_t> spill;
+    _size = effective_size = bulk_fill(
+        slots, n, keys, values, threads, spill,
+        // keys come in by home slot, which is already robin hood order: a
+        // key never sits past one with a later home
+        [](const storage &, size_t home, size_t next, size_t) {
+          return std::max(home, next);
+        });
+    for (size_t i : spill) {
+      put(keys[i], values[i]);
+    }
+  }
+
+  // rebuild with at least n slots, or as many as the current keys need
+  void rehash(size_t n) {
+    while (migrating()) {
+      migrate_step();
+    }
+    [[maybe_unused]] auto timer = counters.time_resize();
+    counters.resized();
+    n = std::bit_ceil(std::max({n, size_t(_size / LF) + 1, size_t(16)}));
+    storage prev = std::exchange(slots, storage(n));
+    size_t prev_capacity = std::exchange(capacity, n);
+    effective_size = 0;
+    if (!_size)
+      return;
+    // clusters in order, starting at an empty slot so none is split. keys
+    // then arrive roughly sorted by home slot and hardly ever displace
+    size_t start = 0;
+    while (prev.occupied(start)) {
+      start++;
+    }
+    for (size_t j = 1; j <= prev_capacity; j++) {
+      size_t i = (start + j) & (prev_capacity - 1);
+      if (prev.occupied(i)) {
+        size_t hash = prev.key(i).hash();
+        place<true>(std::move(prev.key(i)), std::move(prev.value(i)), hash);
+        effective_size++;
+      }
+    }
+  }
+
+  // rebuild at the smallest capacity the keys fit in, and hand what that
+  // frees back to the system
+  void shrink_to_fit() {
+    rehash(0);
+    release_cached<Alloc>();
+  }
+
+  // once an erase takes size() below `fraction` of what capacity() holds at
+  // the load factor, the table is rebuilt at most half full at it. 0 (the
+  // default) never shrinks. capped at 1/8, so after a shrink the size has
+  // to double or halve again before the next resize either way
+  void set_low_water(double fraction) {
+    low_water = std::clamp(fraction, 0.0, 0.125);
+  }
+
+  void clear() {
+    _size = 0;
+    effective_size = 0;
+    slots.clear();
+    old = storage();
+    old_capacity = 0;
+  }
 
-    size_t h = k.hash() & (capacity - 1);
+  void prefetch(const K &k) const {
+    slots.prefetch(k.hash() & (capacity - 1));
+  }
+  size_t size() const { return _size; }
+
+  // f(key, value) for every key, in no particular order
+  template <class F> void for_each(F &&f) const {
+    auto each = [&f](const storage &st, size_t cap) {
+      for (size_t i = st.next_occupied(0); i < cap;
+           i = st.next_occupied(i + 1)) {
+        f(st.key(i), st.value(i));
+      }
+    };
+    each(slots, capacity);
+    if (migrating())
+      each(old, old_capacity);
+  }
+  uint64_t memuse() const {
+    return slots.bytes() + old.bytes() + sizeof(size_t) * 5 +
+           sizeof(double);
+  }
+
+  // the table as a file, and a table over such a file with its slots still
+  // in it. see snapshot.hpp
+  void save(const char *path) const {
+    snapshot_header h = snapshot_header::of<K, V, storage>("robinhood", LF);
+    h.capacity = capacity;
+    h.old_capacity = old_capacity;
+    h.migrated = migrated;
+    h.size = _size;
+    h.effective_size = effective_size;
+    save_snapshot<K, V>(path, h, slots, old);
+  }
+  static robinhood open_mapped(const char *path,
+                               map_mode mode = map_mode::read_only) {
+    robinhood t;
+    auto expect = snapshot_header::of<K, V, storage>("robinhood", LF);
+    snapshot_header h = open_snapshot<K, V>(path, mode, expect, t.slots, t.old);
+    t.capacity = h.capacity;
+    t.old_capacity = h.old_capacity;
+    t.migrated = h.migrated;
+    t._size = h.size;
+    t.effective_size = h.effective_size;
+    check_snapshot(t, t.slots, t.capacity);
+    return t;
+  }
+
+  // see stats.hpp. robin hood has no tombstones, a key's displacement is
+  // just how far past its home slot it sits
+  table_stats stats() const {
+    table_stats s;
+    auto scan = [&s](const storage &st, size_t cap) {
+      scan_slots(s, st, cap, [&](size_t i) {
+        size_t len;
+        probe(st, cap, st.key(i), st.key(i).hash(), len);
+        return len;
+      });
+    };
+    scan(slots, capacity);
+    if (migrating())
+      scan(old, old_capacity);
+    counters.fill(s);
+    return s;
+  }
+
+private:
+  static constexpr size_t resize_step = 64;
+
+  // the slot holding k, or the empty slot the probe ends on. `len` is how
+  // many slots it looked at
+  template <class Q>
+  static size_t probe(const storage &s, size_t cap, const Q &k, size_t hash,
+                      size_t &len) {
+    size_t h = hash & (cap - 1);
+    len = 1;
+    while (s.occupied(h) && (k != s.key(h))) {
+      h = (h + 1) & (cap - 1);
+      len++;
+    }
+    return h;
+  }
+  template <class Q>
+  static size_t probe(const storage &s, size_t cap, const Q &k, size_t hash) {
+    size_t len;
+    return probe(s, cap, k, hash, len);
+  }
+
+  // true if k wasn't in the table yet. `Unique` skips the compare for keys
+  // known to be absent
+  template <bool Unique = false> bool place(K k, V v, size_t hash) {
+    size_t h = hash & (capacity - 1);
     size_t dist = 0;
     for (;;) {
       // what's here then - it's either a tombstone | occupied, and whatever
-      if (occupied[h] == false) {
-        _size++;
-        effective_size++;
-        occupied[h] = true;
-        keys[h] = k;
-        values[h] = v;
-        return;
+      if (!slots.occupied(h)) {
+        slots.set_occupied(h);
+        slots.key(h) = std::move(k);
+        slots.value(h) = std::move(v);
+        return true;
       }
-      if (keys[h] == k) {
-        values[h] = v;
-        return;
+      if constexpr (!Unique) {
+        if (slots.key(h) == k) {
+          slots.value(h) = v;
+          return false;
+        }
       }
       // potentially swap
-      // saves an instruction LOL
-      size_t dist2 = (keys[h].hash() - h + capacity) & (capacity - 1);
+      // how far the resident already is from its home slot
+      size_t dist2 = (h - slots.key(h).hash()) & (capacity - 1);
       if (dist2 < dist) {
-        std::swap(k, keys[h]);
-        std::swap(v, values[h]);
+        std::swap(k, slots.key(h));
+        std::swap(v, slots.value(h));
         dist = dist2;
       }
       dist++;
@@ -86,57 +328,86 @@ public:
     }
   }
 
-  void erase(const K &k) {
-    size_t h = k.hash() & (capacity - 1);
+  // empty slot h and pull the rest of its cluster back
+  static void remove(storage &s, size_t cap, size_t h) {
+    s.set_empty(h);
+    // backwards shift
+    size_t cur = (h + 1) & (cap - 1);
     for (;;) {
-      if (occupied[h] == false)
+      if (!s.occupied(cur))
         return;
-      if (keys[h] == k) {
-        occupied[h] = false;
-        _size--;
-
-        // backwards shift
-        size_t cur = (h + 1) & (capacity - 1);
-        for (;;) {
-          if (occupied[cur] == false)
-            return;
-          if ((keys[cur].hash() & (capacity - 1)) == cur) {
-            // in optimal spot
-            return;
-          }
-          keys[h] = keys[cur];
-          values[h] = values[cur];
-          occupied[cur] = false;
-          h = cur;
-          cur = (cur + 1) & (capacity - 1);
-        }
+      if ((s.key(cur).hash() & (cap - 1)) == cur) {
+        // in optimal spot
         return;
       }
-      h = (h + 1) & (capacity - 1);
+      s.key(h) = std::move(s.key(cur));
+      s.value(h) = std::move(s.value(cur));
+      s.set_occupied(h);
+      s.set_empty(cur);
+      h = cur;
+      cur = (cur + 1) & (cap - 1);
     }
   }
-  void clear() {
-    _size = 0;
-    effective_size = 0;
-    keys.clear();
-    values.clear();
-    occupied.clear();
+
+  // to between a quarter and half full at the load factor
+  void shrink() {
+    size_t n = size_t(2 * _size / LF) + 1;
+    n = std::bit_ceil(std::max(n, size_t(16)));
+    if (n < capacity) {
+      rehash(n);
+      release_cached<Alloc>();
+    }
   }
 
-  size_t prefetch(const K &k) { return 1; }
-  size_t size() const { return _size; }
-  uint64_t memuse() const {
-    return sizeof(K) * capacity + sizeof(V) * capacity +
-           sizeof(bool) * capacity;
+  bool migrating() const { return Incremental && old_capacity; }
+
+  void grow() {
+    if constexpr (Incremental) {
+      while (migrating()) {
+        migrate_step();
+      }
+      counters.resized();
+      old = std::move(slots);
+      old_capacity = capacity;
+      migrated = 0;
+      capacity *= 2;
+      slots = storage(capacity);
+      effective_size = 0;
+    } else {
+      rehash(capacity * 2);
+    }
   }
 
-private:
-  int capacity = 0;
-  int _size = 0;
-  int effective_size = 0;
-  std::vector<K> keys;
-  std::vector<V> values;
-  std::vector<bool> occupied;
+  // removing a key shifts its cluster back, so a slot is only passed once
+  // it is empty. each step either passes a slot or moves a key
+  void migrate_step() {
+    [[maybe_unused]] auto timer = counters.time_resize();
+    for (size_t n = 0; n < resize_step && migrated < old_capacity; n++) {
+      if (!old.occupied(migrated)) {
+        migrated++;
+        continue;
+      }
+      size_t hash = old.key(migrated).hash();
+      place<true>(std::move(old.key(migrated)), std::move(old.value(migrated)),
+                  hash);
+      remove(old, old_capacity, migrated);
+      effective_size++;
+    }
+    if (migrated == old_capacity) {
+      old = storage();
+      old_capacity = 0;
+    }
+  }
+
+  size_t capacity = 0;
+  size_t _size = 0;
+  size_t effective_size = 0;
+  storage slots;
+  storage old;
+  size_t old_capacity = 0; // nonzero while migrating out of `old`
+  size_t migrated = 0;     // old slots below this are empty
+  double low_water = 0;
+  [[no_unique_address]] stats_counters counters;
 };
 
 } // namespace crash
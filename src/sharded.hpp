@@ -0,0 +1,143 @@
+#pragma once
+
+#ifndef SHARDED_HPP
+#define SHARDED_HPP
+
+#include <array>
+#include <bit>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+
+#include "common.hpp"
+
+namespace crash {
+
+// makes any of the single threaded engines thread safe by splitting it into
+// `Shards` independent tables, each behind its own reader-writer lock. keys
+// are routed by the top bits of their hash, the engines index with the low
+// bits. every shard grows on its own, so a resize only blocks that shard
+template <class Engine, size_t Shards = 64>
+  requires(std::has_single_bit(Shards))
+class sharded {
+public:
+  using K = typename Engine::K;
+  using V = typename Engine::V;
+
+  sharded(size_t size = 16 * Shards) {
+    for (auto &s : shards) {
+      s.table = Engine(std::bit_ceil(std::max<size_t>(size / Shards, 16)));
+    }
+  }
+  sharded(const sharded &) = delete;
+  sharded &operator=(const sharded &) = delete;
+
+  std::optional<V> get(const K &k) const { return get(k, k.hash()); }
+  template <Lookup<K> Q> std::optional<V> get(const Q &q) const {
+    return get(q, K::hash_of(q));
+  }
+  template <class Q> std::optional<V> get(const Q &k, size_t hash) const {
+    auto &s = shard_for(hash);
+    std::shared_lock l(s.lock);
+    return s.table.get(k, hash);
+  }
+
+  V find(const K &k) const {
+    auto &s = shard_for(k.hash());
+    std::shared_lock l(s.lock);
+    return s.table.find(k);
+  }
+
+  void put(const K &k, V v) { put(k, v, k.hash()); }
+  void put(const K &k, V v, size_t hash) {
+    auto &s = shard_for(hash);
+    std::unique_lock l(s.lock);
+    s.table.put(k, v, hash);
+  }
+
+  void erase(const K &k) {
+    auto &s = shard_for(k.hash());
+    std::unique_lock l(s.lock);
+    s.table.erase(k);
+  }
+
+  // one lock per key, batching across shards would need the keys grouped
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    for (size_t i = 0; i < ks.size(); i++) {
+      out[i] = get(ks[i]);
+    }
+  }
+  void put_batch(std::span<const K> ks, std::span<const V> vs) {
+    for (size_t i = 0; i < ks.size(); i++) {
+      put(ks[i], vs[i]);
+    }
+  }
+
+  void clear() {
+    for (auto &s : shards) {
+      std::unique_lock l(s.lock);
+      s.table.clear();
+    }
+  }
+
+  void shrink_to_fit() {
+    for (auto &s : shards) {
+      std::unique_lock l(s.lock);
+      s.table.shrink_to_fit();
+    }
+  }
+  // per shard, each one shrinks on its own
+  void set_low_water(double fraction) {
+    for (auto &s : shards) {
+      std::unique_lock l(s.lock);
+      s.table.set_low_water(fraction);
+    }
+  }
+
+  // not a snapshot, shards are read one at a time
+  size_t size() const {
+    size_t n = 0;
+    for (auto &s : shards) {
+      std::shared_lock l(s.lock);
+      n += s.table.size();
+    }
+    return n;
+  }
+  uint64_t memuse() const {
+    uint64_t n = sizeof(*this);
+    for (auto &s : shards) {
+      std::shared_lock l(s.lock);
+      n += s.table.memuse();
+    }
+    return n;
+  }
+
+private:
+  static constexpr int shard_bits = std::countr_zero(Shards);
+
+  // fibonacci hashing first, so identity hashes still spread over the shards
+  static size_t shard_index(size_t hash) {
+    if constexpr (Shards == 1)
+      return 0;
+    else
+      return (hash * 0x9E3779B97F4A7C15ULL) >> (64 - shard_bits);
+  }
+
+  // padded so neighbouring locks don't share a cache line
+  struct alignas(64) shard {
+    mutable std::shared_mutex lock;
+    Engine table;
+  };
+
+  const shard &shard_for(size_t hash) const {
+    return shards[shard_index(hash)];
+  }
+  shard &shard_for(size_t hash) { return shards[shard_index(hash)]; }
+
+  std::array<shard, Shards> shards;
+};
+
+} // namespace crash
+
+#endif
@@ -0,0 +1,260 @@
+#pragma once
+
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <typeinfo>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.hpp"
+
+namespace crash {
+
+// a table's slot arrays written out byte for byte, so a restart can map the
+// file back instead of replaying every put. linear, quadratic and robinhood
+// have
+//
+//   void save(const char *path) const
+//   static E open_mapped(const char *path, map_mode mode = read_only)
+//
+// the file is a snapshot_header, then every array of the layout's storage
+// (see arrays() in layout.hpp) starting on a page boundary. an opened
+// table's arrays point straight into the mapping: opening is a few
+// syscalls, and each page is faulted in the first time a lookup touches it.
+// the mapping lives as long as the last array borrowing it, so until the
+// table's first resize or its destructor.
+//
+// keys and values go in as they are, so they have to be plain bytes:
+// trivially copyable and without pointers (string_key points into its
+// arena). a file only opens with the same engine, key and value types,
+// layout and load factor that saved it, on a machine with the same byte
+// order. anything else is refused with std::runtime_error, I/O errors are
+// std::system_error
+
+template <class Hash> class string_key;
+
+template <class T>
+inline constexpr bool snapshot_safe = std::is_trivially_copyable_v<T>;
+template <class Hash>
+inline constexpr bool snapshot_safe<string_key<Hash>> = false;
+
+enum class map_mode {
+  // shared and read only. the table must only be read, a put, erase or
+  // clear faults on the first write
+  read_only,
+  // private and writable. a write copies the page it lands on, the file
+  // never changes
+  copy_on_write,
+};
+
+struct snapshot_header {
+  static constexpr char expected_magic[8] = {'c', 'r', 'a', 's',
+                                             'h', 's', 'n', 'p'};
+  static constexpr uint32_t current_version = 1;
+  static constexpr size_t max_arrays = 8;
+  static constexpr size_t align = 4096;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t load_factor; // percent
+  char engine[16];
+  uint64_t layout; // type of the storage, covers K, V, layout and Alloc
+  uint64_t hash;   // type of K, which names its hash function
+  uint64_t key_bytes;
+  uint64_t value_bytes;
+  uint64_t endian;
+
+  // the engine's counters, whichever it has
+  uint64_t capacity;
+  uint64_t old_capacity;
+  uint64_t migrated;
+  uint64_t size;
+  uint64_t effective_size;
+  uint64_t tombstones;
+
+  uint64_t arrays;
+  uint64_t offset[max_arrays];
+  uint64_t bytes[max_arrays];
+
+  // what a table of this engine, K, V and storage writes, counters zeroed
+  template <class K, class V, class Storage>
+  static snapshot_header of(const char *engine, double lf) {
+    snapshot_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, expected_magic, sizeof(h.magic));
+    h.version = current_version;
+    h.load_factor = uint32_t(lf * 100 + 0.5);
+    std::strncpy(h.engine, engine, sizeof(h.engine) - 1);
+    h.layout = type_id<Storage>();
+    h.hash = type_id<K>();
+    h.key_bytes = sizeof(K);
+    h.value_bytes = sizeof(V);
+    h.endian = 0x0102030405060708ULL;
+    return h;
+  }
+
+  // everything but the counters and the arrays
+  bool same_table(const snapshot_header &o) const {
+    return std::memcmp(magic, o.magic, sizeof(magic)) == 0 &&
+           version == o.version && load_factor == o.load_factor &&
+           std::strncmp(engine, o.engine, sizeof(engine)) == 0 &&
+           layout == o.layout && hash == o.hash &&
+           key_bytes == o.key_bytes && value_bytes == o.value_bytes &&
+           endian == o.endian;
+  }
+
+private:
+  template <class T> static uint64_t type_id() {
+    const char *name = typeid(T).name();
+    return wyhash64(name, std::strlen(name));
+  }
+};
+
+namespace detail {
+// closes fd, if there is one, without losing errno
+[[noreturn]] inline void snapshot_io_error(const std::string &what,
+                                           int fd = -1) {
+  int e = errno;
+  if (fd >= 0)
+    ::close(fd);
+  throw std::system_error(e, std::generic_category(), "snapshot: " + what);
+}
+} // namespace detail
+
+// writes h and the arrays of `slots` and `old` to `path`. it goes to a
+// temporary next to it first and is renamed over, so a crash halfway leaves
+// whatever snapshot was there before
+template <class K, class V, class Storage>
+void save_snapshot(const char *path, snapshot_header h, const Storage &slots,
+                   const Storage &old) {
+  static_assert(snapshot_safe<K> && snapshot_safe<V>,
+                "snapshots need keys and values that are plain bytes");
+  const void *data[snapshot_header::max_arrays];
+  uint64_t end = (sizeof(h) + h.align - 1) & ~(h.align - 1);
+  auto add = [&](const auto &a) {
+    if (h.arrays == h.max_arrays)
+      throw std::runtime_error("snapshot: too many arrays");
+    data[h.arrays] = a.data();
+    h.offset[h.arrays] = end;
+    h.bytes[h.arrays] = a.size() * sizeof(a[0]);
+    end = (end + h.bytes[h.arrays] + h.align - 1) & ~(h.align - 1);
+    h.arrays++;
+  };
+  slots.arrays(add);
+  old.arrays(add);
+
+  std::string tmp = std::string(path) + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    detail::snapshot_io_error("can't create " + tmp);
+  auto write_at = [&](const void *p, uint64_t bytes, uint64_t at) {
+    const char *c = static_cast<const char *>(p);
+    while (bytes) {
+      ssize_t n = ::pwrite(fd, c, bytes, at);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        detail::snapshot_io_error("can't write " + tmp, fd);
+      c += n;
+      at += n;
+      bytes -= n;
+    }
+  };
+  write_at(&h, sizeof(h), 0);
+  for (size_t i = 0; i < h.arrays; i++) {
+    write_at(data[i], h.bytes[i], h.offset[i]);
+  }
+  if (::ftruncate(fd, end) != 0 || ::fsync(fd) != 0)
+    detail::snapshot_io_error("can't write " + tmp, fd);
+  ::close(fd);
+  if (std::rename(tmp.c_str(), path) != 0)
+    detail::snapshot_io_error(std::string("can't rename to ") + path);
+}
+
+// maps `path` and points the arrays of `slots` and `old` into it. the
+// header has to match `expect` (see same_table), its counters are returned
+template <class K, class V, class Storage>
+snapshot_header open_snapshot(const char *path, map_mode mode,
+                              const snapshot_header &expect, Storage &slots,
+                              Storage &old) {
+  static_assert(snapshot_safe<K> && snapshot_safe<V>,
+                "snapshots need keys and values that are plain bytes");
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    detail::snapshot_io_error(std::string("can't open ") + path);
+  struct stat st;
+  if (::fstat(fd, &st) != 0)
+    detail::snapshot_io_error(std::string("can't stat ") + path, fd);
+  size_t len = st.st_size;
+  if (len < sizeof(snapshot_header)) {
+    ::close(fd);
+    throw std::runtime_error(std::string("snapshot: ") + path +
+                             " is too short");
+  }
+  bool cow = mode == map_mode::copy_on_write;
+  void *p = ::mmap(nullptr, len, cow ? PROT_READ | PROT_WRITE : PROT_READ,
+                   cow ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    detail::snapshot_io_error(std::string("can't map ") + path, fd);
+  ::close(fd);
+  std::shared_ptr<void> mapping(p, [len](void *p) { ::munmap(p, len); });
+
+  snapshot_header h;
+  std::memcpy(&h, p, sizeof(h));
+  if (!h.same_table(expect))
+    throw std::runtime_error(std::string("snapshot: ") + path +
+                             " was saved by a different kind of table");
+  if (h.arrays > h.max_arrays)
+    throw std::runtime_error("snapshot: too many arrays");
+  size_t i = 0;
+  auto borrow = [&](auto &a) {
+    using array = std::remove_reference_t<decltype(a)>;
+    using T = typename array::value_type;
+    if (i == h.arrays || h.offset[i] % h.align || h.bytes[i] % sizeof(T) ||
+        h.offset[i] > len || h.bytes[i] > len - h.offset[i])
+      throw std::runtime_error(std::string("snapshot: ") + path +
+                               " is corrupt");
+    T *at = reinterpret_cast<T *>(static_cast<char *>(p) + h.offset[i]);
+    a = array::borrow(at, h.bytes[i] / sizeof(T), mapping);
+    i++;
+  };
+  slots.arrays(borrow);
+  old.arrays(borrow);
+  if (i != h.arrays || slots.capacity() != h.capacity ||
+      old.capacity() != h.old_capacity)
+    throw std::runtime_error(std::string("snapshot: ") + path +
+                             " is corrupt");
+  return h;
+}
+
+// a hash function changed without its key type changing would put every
+// lookup in the wrong place. `t` was just opened, check that the first few
+// keys in `slots` can still be found
+template <class Table, class Storage>
+void check_snapshot(const Table &t, const Storage &slots, size_t cap) {
+  size_t checked = 0;
+  for (size_t i = slots.next_occupied(0); i < cap && checked < 64;
+       i = slots.next_occupied(i + 1), checked++) {
+    if (!t.get(slots.key(i)))
+      throw std::runtime_error(
+          "snapshot: keys aren't where their hash puts them, was it saved "
+          "with a different hash function?");
+  }
+}
+
+} // namespace crash
+
+#endif
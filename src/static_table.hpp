@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef STATIC_TABLE_HPP
+#define STATIC_TABLE_HPP
+
+#include <array>
+#include <bit>
+#include <optional>
+#include <span>
+
+#include "common.hpp"
+#include "probe.hpp"
+
+namespace crash {
+
+// a linear probing table for small maps with a known bound, all of it inside
+// the object: no allocation, no resizing, and the mask is a constant. holds
+// up to `Capacity` keys, in enough slots that it's never more than 70% full.
+// erase shifts back like linear does, so churn can't fill it with
+// tombstones. a put that would go past `Capacity` is refused.
+//
+// trivially copyable when K and V are, and everything is constexpr (given a
+// constexpr hash), so a table can be built at compile time:
+//
+//   constexpr auto t = [] {
+//     static_table<i64, int, 16> t;
+//     t.put(1, 2);
+//     return t;
+//   }();
+//   static_assert(t.get(1) == 2);
+template <class Key, class Value, size_t Capacity>
+  requires Hashable<Key> && (Capacity > 0)
+class static_table {
+public:
+  using K = Key;
+  using V = Value;
+  static constexpr size_t slot_count = std::bit_ceil(Capacity * 10 / 7 + 1);
+
+  constexpr std::optional<V> get(const K &k) const { return get(k, k.hash()); }
+  template <Lookup<K> Q> constexpr std::optional<V> get(const Q &q) const {
+    return get(q, K::hash_of(q));
+  }
+  template <class Q>
+  constexpr std::optional<V> get(const Q &k, size_t hash) const {
+    size_t len;
+    size_t h = linear_probe(slots, mask, k, hash, len);
+    if (slots.occupied(h))
+      return slots.value(h);
+    return {};
+  }
+
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    for (size_t i = 0; i < ks.size(); i++) {
+      out[i] = get(ks[i]);
+    }
+  }
+
+  // false if k is new and the table already holds `Capacity` keys
+  constexpr bool put(const K &k, V v) { return put(k, v, k.hash()); }
+  constexpr bool put(const K &k, V v, size_t hash) {
+    size_t len;
+    size_t h = linear_probe(slots, mask, k, hash, len);
+    if (slots.occupied(h)) {
+      slots.value(h) = v;
+      return true;
+    }
+    if (sz == Capacity)
+      return false;
+    sz++;
+    slots.set_occupied(h);
+    slots.key(h) = k;
+    slots.value(h) = v;
+    return true;
+  }
+
+  constexpr void erase(const K &k) {
+    size_t len;
+    size_t h = linear_probe(slots, mask, k, k.hash(), len);
+    if (slots.occupied(h)) {
+      linear_erase(slots, mask, h);
+      sz--;
+    }
+  }
+
+  constexpr void clear() {
+    slots.full = {};
+    sz = 0;
+  }
+
+  constexpr size_t size() const { return sz; }
+  static constexpr size_t capacity() { return Capacity; }
+  uint64_t memuse() const { return sizeof(*this); }
+
+private:
+  static constexpr size_t mask = slot_count - 1;
+
+  // the storage interface the probing kernels expect, over inline arrays
+  struct storage {
+    std::array<K, slot_count> keys{};
+    std::array<V, slot_count> values{};
+    std::array<bool, slot_count> full{};
+
+    constexpr K &key(size_t i) { return keys[i]; }
+    constexpr const K &key(size_t i) const { return keys[i]; }
+    constexpr V &value(size_t i) { return values[i]; }
+    constexpr const V &value(size_t i) const { return values[i]; }
+
+    constexpr bool occupied(size_t i) const { return full[i]; }
+    constexpr bool used(size_t i) const { return full[i]; }
+    constexpr void set_occupied(size_t i) { full[i] = true; }
+    constexpr void set_empty(size_t i) { full[i] = false; }
+  };
+
+  storage slots;
+  size_t sz = 0;
+};
+
+} // namespace crash
+
+#endif
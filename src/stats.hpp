@@ -0,0 +1,180 @@
+#pragma once
+
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+namespace crash {
+
+// what the engines can say about why they are slow. `stats()` on an engine
+// returns a table_stats, in two parts:
+//
+//   shape     displacement, tombstones and clusters, read off the slots when
+//             stats() is called. always there, and free until it's called
+//   counters  probe lengths of every lookup, resize count and time. only
+//             compiled in with -DCRASH_STATS, otherwise every hook below is
+//             an empty inline function and the counters take no space
+//
+// a bad hash shows up as long clusters and displacement at any probe scheme,
+// a bad scheme as long probes on top of well spread home slots
+#if defined(CRASH_STATS)
+constexpr bool stats_enabled = true;
+#else
+constexpr bool stats_enabled = false;
+#endif
+
+// slots looked at per lookup, 1 is the home slot. bucket i holds lengths in
+// [2^(i-1), 2^i), so 1 | 2-3 | 4-7 | ...
+struct probe_histogram {
+  std::array<uint64_t, 24> buckets{};
+  uint64_t count = 0;
+  uint64_t total = 0;
+  uint64_t longest = 0;
+
+  void add(size_t len) {
+    bump(buckets[std::min<size_t>(std::bit_width(len), buckets.size() - 1)]);
+    bump(count);
+    bump(total, len);
+    std::atomic_ref l(longest);
+    if (len > l.load(std::memory_order_relaxed))
+      l.store(len, std::memory_order_relaxed);
+  }
+  double average() const { return count ? double(total) / count : 0; }
+  // upper bound of the bucket holding the q-th quantile
+  uint64_t quantile(double q) const {
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+      seen += buckets[i];
+      if (seen && seen >= q * count)
+        return std::min((uint64_t(1) << i) - 1, longest);
+    }
+    return longest;
+  }
+
+  // engines are read from several threads at once (sharded, concurrent), so
+  // counts go through relaxed atomics. a load and a store rather than an
+  // add: racing threads can lose a count, but nobody waits on a locked add
+  static void bump(uint64_t &c, uint64_t by = 1) {
+    std::atomic_ref r(c);
+    r.store(r.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+  }
+};
+
+struct table_stats {
+  // shape
+  size_t size = 0;
+  size_t capacity = 0;
+  size_t tombstones = 0;
+  size_t max_displacement = 0; // extra slots past home to reach a key
+  double avg_displacement = 0;
+  size_t longest_cluster = 0; // run of slots that are not empty
+
+  // counters, zero without CRASH_STATS
+  probe_histogram hits;
+  probe_histogram misses;
+  uint64_t resizes = 0;
+  uint64_t resize_ns = 0; // rehashing, or migrating for incremental tables
+
+  double tombstone_ratio() const {
+    return capacity ? double(tombstones) / capacity : 0;
+  }
+};
+
+// the counting half, one per engine. everything is const so lookups can
+// count too
+class stats_counters {
+public:
+#if defined(CRASH_STATS)
+  void hit(size_t len) const { hits.add(len); }
+  void miss(size_t len) const { misses.add(len); }
+  void resized() const { probe_histogram::bump(resizes); }
+
+  // adds the time until it goes out of scope to the resize time
+  class resize_timer {
+  public:
+    explicit resize_timer(const stats_counters &c)
+        : c(c), start(std::chrono::steady_clock::now()) {}
+    ~resize_timer() {
+      probe_histogram::bump(
+          c.resize_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count());
+    }
+
+  private:
+    const stats_counters &c;
+    std::chrono::steady_clock::time_point start;
+  };
+  resize_timer time_resize() const { return resize_timer(*this); }
+
+  void fill(table_stats &s) const {
+    s.hits = hits;
+    s.misses = misses;
+    s.resizes = resizes;
+    s.resize_ns = resize_ns;
+  }
+
+private:
+  mutable probe_histogram hits;
+  mutable probe_histogram misses;
+  mutable uint64_t resizes = 0;
+  mutable uint64_t resize_ns = 0;
+#else
+  void hit(size_t) const {}
+  void miss(size_t) const {}
+  void resized() const {}
+  struct resize_timer {};
+  resize_timer time_resize() const { return {}; }
+  void fill(table_stats &) const {}
+#endif
+};
+
+// the shape part of `s` from a layout's storage<K, V, Alloc>.
+// `probe_len(i)` is how many slots a lookup of the key in slot i looks at.
+// clusters wrap around the end, like probes do
+template <class Storage, class ProbeLen>
+void scan_slots(table_stats &s, const Storage &slots, size_t cap,
+                ProbeLen &&probe_len) {
+  size_t displaced = 0;
+  size_t keys = 0;
+  size_t run = 0;
+  size_t first_run = 0; // the run at the start, joins the one at the end
+  bool wrapped = false;
+  for (size_t i = 0; i < cap; i++) {
+    if (slots.tombstone(i))
+      s.tombstones++;
+    if (slots.occupied(i)) {
+      size_t d = probe_len(i) - 1;
+      displaced += d;
+      keys++;
+      s.max_displacement = std::max(s.max_displacement, d);
+    }
+    if (slots.used(i)) {
+      run++;
+    } else {
+      if (!wrapped)
+        first_run = run;
+      wrapped = true;
+      s.longest_cluster = std::max(s.longest_cluster, run);
+      run = 0;
+    }
+  }
+  s.longest_cluster =
+      std::max(s.longest_cluster, wrapped ? run + first_run : run);
+  s.capacity += cap;
+  if (keys) {
+    s.avg_displacement = (s.avg_displacement * s.size + displaced) /
+                         double(s.size + keys);
+  }
+  s.size += keys;
+}
+
+} // namespace crash
+
+#endif
@@ -0,0 +1,168 @@
+#pragma once
+
+#ifndef STRING_KEY_HPP
+#define STRING_KEY_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.hpp"
+
+namespace crash {
+
+// append-only home for the bytes of long keys. keys only keep a pointer in,
+// so an arena has to outlive every key made with it, and nothing is handed
+// back before the arena itself goes away
+class string_arena {
+public:
+  string_arena() = default;
+  string_arena(const string_arena &) = delete;
+  string_arena &operator=(const string_arena &) = delete;
+
+  const char *store(std::string_view s) {
+    std::lock_guard l(lock);
+    if (s.size() > left) {
+      size_t n = std::max(block, s.size());
+      chunks.push_back(std::make_unique<char[]>(n));
+      cur = chunks.back().get();
+      left = n;
+      reserved += n;
+    }
+    char *p = cur;
+    std::memcpy(p, s.data(), s.size());
+    cur += s.size();
+    left -= s.size();
+    return p;
+  }
+
+  uint64_t bytes() const {
+    std::lock_guard l(lock);
+    return reserved;
+  }
+
+  // the default for keys that weren't given one. never destroyed, so keys in
+  // static tables can't outlive it
+  static string_arena &shared() {
+    static string_arena *a = new string_arena();
+    return *a;
+  }
+
+private:
+  static constexpr size_t block = 1 << 20;
+
+  mutable std::mutex lock;
+  std::vector<std::unique_ptr<char[]>> chunks;
+  char *cur = nullptr;
+  size_t left = 0;
+  uint64_t reserved = 0;
+};
+
+struct djb2 {
+  size_t operator()(std::string_view s) const {
+    size_t hash = 5381;
+    for (unsigned char c : s)
+      hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    return hash;
+  }
+};
+
+// variable length string key, 32 bytes no matter how long the string is.
+// up to `inline_size` bytes live in the key itself. longer ones keep their
+// first bytes inline and the whole string in a string_arena, so most
+// mismatches are settled without following the pointer. the hash is computed
+// once on construction, and compares check it and the length first.
+//
+// trivially copyable: copies share the arena bytes. a default constructed
+// key is only a placeholder for an empty slot and equals nothing real
+template <class Hash = djb2> class string_key {
+public:
+  static constexpr size_t inline_size = 20;
+  static constexpr size_t prefix_size = 12;
+
+  string_key() = default;
+  string_key(std::string_view s, string_arena &arena = string_arena::shared())
+      : h(Hash{}(s)), len(s.size()) {
+    std::memset(data, 0, sizeof(data));
+    if (len <= inline_size) {
+      std::memcpy(data, s.data(), len);
+    } else {
+      std::memcpy(data, s.data(), prefix_size);
+      const char *p = arena.store(s);
+      std::memcpy(data + prefix_size, &p, sizeof(p));
+    }
+  }
+  string_key(const std::string &s) : string_key(std::string_view(s)) {}
+  string_key(const char *s) : string_key(std::string_view(s)) {}
+
+  // for lookups that only have the bytes, hashes the same as the key would
+  static size_t hash_of(std::string_view s) { return Hash{}(s); }
+
+  size_t hash() const { return h; }
+  size_t size() const { return len; }
+  std::string_view view() const { return {chars(), len}; }
+
+  bool operator==(const string_key &o) const {
+    if (h != o.h || len != o.len)
+      return false;
+    // short keys are zero padded, so the whole inline part can be compared
+    if (len <= inline_size)
+      return std::memcmp(data, o.data, inline_size) == 0;
+    return std::memcmp(data, o.data, prefix_size) == 0 &&
+           std::memcmp(chars(), o.chars(), len) == 0;
+  }
+  // no hash to go on here, the length and the inline prefix have to do
+  bool operator==(std::string_view s) const {
+    if (len != s.size())
+      return false;
+    if (len > inline_size && std::memcmp(data, s.data(), prefix_size) != 0)
+      return false;
+    return std::memcmp(chars(), s.data(), len) == 0;
+  }
+  bool operator==(const char *s) const {
+    return *this == std::string_view(s);
+  }
+  int operator<=>(const string_key &o) const {
+    return view().compare(o.view());
+  }
+
+private:
+  const char *chars() const {
+    if (len <= inline_size)
+      return data;
+    const char *p;
+    std::memcpy(&p, data + prefix_size, sizeof(p));
+    return p;
+  }
+
+  size_t h;
+  uint32_t len;
+  char data[inline_size]; // the string, or a prefix and the arena pointer
+};
+
+template <class Hash>
+std::ostream &operator<<(std::ostream &os, const string_key<Hash> &s) {
+  os << s.view();
+  return os;
+}
+
+typedef string_key<> StringKey;
+
+// lengths spread over 8-200 bytes, like real identifiers
+struct gen_string_key {
+  gen_string_key() : rng(3, 7) {}
+  StringKey get() {
+    return StringKey(gen_string::generate(8 + rng.get() % 193));
+  }
+  pcg32 rng;
+};
+
+} // namespace crash
+
+#endif
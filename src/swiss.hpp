@@ -0,0 +1,334 @@
+#pragma once
+
+#ifndef SWISS_HPP
+#define SWISS_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "alloc.hpp"
+#include "common.hpp"
+
+namespace crash {
+
+// one control byte per slot: empty, deleted, or the low 7 bits of the hash
+enum ctrl_t : int8_t {
+  ctrl_empty = -128, // 0b10000000
+  ctrl_deleted = -2, // 0b11111110
+};
+
+// a group is `width` consecutive control bytes checked in one go.
+// match* return a bitmask with bit i set if slot i of the group matches
+#if defined(__AVX2__)
+struct group_avx2 {
+  static constexpr size_t width = 32;
+  explicit group_avx2(const int8_t *p)
+      : ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p))) {}
+
+  uint32_t match(int8_t h2) const {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl));
+  }
+  uint32_t match_empty() const {
+    return _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_set1_epi8(ctrl_empty), ctrl));
+  }
+  // empty and deleted are the only states with the sign bit set
+  uint32_t match_empty_or_deleted() const {
+    return _mm256_movemask_epi8(ctrl);
+  }
+
+  __m256i ctrl;
+};
+#endif
+
+#if defined(__SSE2__)
+struct group_sse2 {
+  static constexpr size_t width = 16;
+  explicit group_sse2(const int8_t *p)
+      : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))) {}
+
+  uint32_t match(int8_t h2) const {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl));
+  }
+  uint32_t match_empty() const {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(ctrl_empty), ctrl));
+  }
+  uint32_t match_empty_or_deleted() const { return _mm_movemask_epi8(ctrl); }
+
+  __m128i ctrl;
+};
+#endif
+
+// SWAR fallback, 8 slots per word. match() can report false positives on
+// the byte after a real match, which is fine since keys are compared anyway
+struct group_portable {
+  static constexpr size_t width = 8;
+  static constexpr uint64_t lsbs = 0x0101010101010101ULL;
+  static constexpr uint64_t msbs = 0x8080808080808080ULL;
+  explicit group_portable(const int8_t *p) { std::memcpy(&ctrl, p, 8); }
+
+  uint32_t match(int8_t h2) const {
+    uint64_t x = ctrl ^ (lsbs * static_cast<uint8_t>(h2));
+    return compress((x - lsbs) & ~x & msbs);
+  }
+  // empty is the only state with the sign bit set and bit 1 clear
+  uint32_t match_empty() const { return compress(ctrl & ~(ctrl << 6) & msbs); }
+  uint32_t match_empty_or_deleted() const { return compress(ctrl & msbs); }
+
+  // one bit per byte, from the high bit of each byte
+  static uint32_t compress(uint64_t m) {
+    uint32_t r = 0;
+    for (int i = 0; i < 8; i++) {
+      r |= ((m >> (8 * i + 7)) & 1) << i;
+    }
+    return r;
+  }
+
+  uint64_t ctrl;
+};
+
+#if defined(__AVX2__)
+using group = group_avx2;
+#elif defined(__SSE2__)
+using group = group_sse2;
+#else
+using group = group_portable;
+#endif
+
+// open addressing over groups of control bytes, triangular probing between
+// groups. the 7 bit tag in the control byte filters out nearly every key
+// compare that would fail
+template <class Key, class Value, int LoadFactor,
+          class Alloc = slab_allocator<Key>>
+  requires Hashable<Key>
+class swiss {
+public:
+  using K = Key;
+  using V = Value;
+  static constexpr double LF = LoadFactor / 100.0;
+
+  swiss(size_t size_ = 16)
+      : capacity(std::max(std::bit_ceil(size_), group::width)), keys(capacity),
+        values(capacity), ctrl(capacity, ctrl_empty) {}
+
+  std::optional<V> get(const K &k) const { return get(k, k.hash()); }
+  // by anything a key compares equal to, e.g. a string_view for string_key,
+  // without building a key first
+  template <Lookup<K> Q> std::optional<V> get(const Q &q) const {
+    return get(q, K::hash_of(q));
+  }
+
+  void get_batch(std::span<const K> ks, std::span<std::optional<V>> out) const {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { prefetch_group(h); },
+        [&](size_t i, size_t h) { out[i] = get(ks[i], h); });
+  }
+
+  template <class Q> std::optional<V> get(const Q &k, size_t hash) const {
+    size_t slot = find_slot(k, hash);
+    if (slot == npos)
+      return {};
+    return values[slot];
+  }
+
+  V find(const K &k) const {
+    size_t slot = find_slot(k, k.hash());
+    if (slot == npos)
+      return V{};
+    return values[slot];
+  }
+
+  void put(const K &k, V v) { put(k, v, k.hash()); }
+
+  void put_batch(std::span<const K> ks, std::span<const V> vs) {
+    batch_pipeline(
+        ks.size(), [&](size_t i) { return ks[i].hash(); },
+        [&](size_t h) { prefetch_group(h); },
+        [&](size_t i, size_t h) { put(ks[i], vs[i], h); });
+  }
+
+  void put(const K &k, V v, size_t h) {
+    int8_t tag = h2(h);
+    size_t g = h1(h) & (groups() - 1);
+    size_t target = npos;
+    for (size_t i = 1;; i++) {
+      group grp(&ctrl[g * group::width]);
+      for (uint32_t m = grp.match(tag); m; m &= m - 1) {
+        size_t slot = g * group::width + std::countr_zero(m);
+        if (keys[slot] == k) {
+          values[slot] = v;
+          return;
+        }
+      }
+      if (target == npos) {
+        if (uint32_t m = grp.match_empty_or_deleted())
+          target = g * group::width + std::countr_zero(m);
+      }
+      if (grp.match_empty())
+        break;
+      g = (g + i) & (groups() - 1);
+    }
+
+    _size++;
+    if (ctrl[target] == ctrl_empty)
+      effective_size++;
+    ctrl[target] = tag;
+    keys[target] = k;
+    values[target] = v;
+
+    if (effective_size >= capacity * LF) {
+      // mostly tombstones, so clean up in place instead of doubling
+      rehash(_size * 2 < capacity * LF ? capacity : capacity * 2);
+    }
+  }
+
+  void erase(const K &k) {
+    size_t slot = find_slot(k, k.hash());
+    if (slot == npos)
+      return;
+    _size--;
+    // a probe only walks past this group if it had no empty slot, so if it
+    // still has one nothing can depend on this slot being non-empty
+    if (group(&ctrl[slot & ~(group::width - 1)]).match_empty()) {
+      ctrl[slot] = ctrl_empty;
+      effective_size--;
+    } else {
+      ctrl[slot] = ctrl_deleted;
+    }
+    if (_size < capacity * LF * low_water)
+      shrink();
+  }
+
+  // room for n keys before the next resize
+  void reserve(size_t n) { rehash(size_t(n / LF) + 1); }
+
+  // rebuild with at least n slots, or as many as the current keys need.
+  // also how tombstones get cleared out
+  void rehash(size_t n) {
+    n = std::max(std::bit_ceil(std::max(n, size_t(_size / LF) + 1)),
+                 group::width);
+    auto prev_keys = std::exchange(keys, alloc_vector<K, Alloc>(n));
+    auto prev_values = std::exchange(values, alloc_vector<V, Alloc>(n));
+    auto prev_ctrl =
+        std::exchange(ctrl, alloc_vector<int8_t, Alloc>(n, ctrl_empty));
+    capacity = n;
+    _size = 0;
+    effective_size = 0;
+    for (size_t i = 0; i < prev_ctrl.size(); i++) {
+      if (prev_ctrl[i] >= 0) {
+        insert_unique(std::move(prev_keys[i]), std::move(prev_values[i]));
+      }
+    }
+  }
+
+  // rebuild at the smallest capacity the keys fit in, and hand what that
+  // frees back to the system
+  void shrink_to_fit() {
+    rehash(0);
+    release_cached<Alloc>();
+  }
+
+  // once an erase takes size() below `fraction` of what capacity() holds at
+  // the load factor, the table is rebuilt at most half full at it. 0 (the
+  // default) never shrinks. capped at 1/8, so after a shrink the size has
+  // to double or halve again before the next resize either way
+  void set_low_water(double fraction) {
+    low_water = std::clamp(fraction, 0.0, 0.125);
+  }
+
+  void clear() {
+    _size = 0;
+    effective_size = 0;
+    std::fill(ctrl.begin(), ctrl.end(), ctrl_empty);
+  }
+
+  void prefetch(const K &k) const { prefetch_group(k.hash()); }
+  size_t size() const { return _size; }
+  uint64_t memuse() const {
+    return sizeof(K) * keys.size() + sizeof(V) * values.size() + ctrl.size() +
+           sizeof(size_t) * 3 + sizeof(double);
+  }
+
+private:
+  static constexpr size_t npos = ~size_t(0);
+
+  static size_t h1(size_t h) { return h >> 7; }
+  static int8_t h2(size_t h) { return h & 0x7f; }
+  size_t groups() const { return capacity / group::width; }
+
+  // the control bytes, and the first keys and values of the home group.
+  // which key will be compared isn't known until the tags are checked
+  void prefetch_group(size_t h) const {
+    size_t slot = (h1(h) & (groups() - 1)) * group::width;
+    prefetch_read(&ctrl[slot]);
+    prefetch_read(&keys[slot]);
+    prefetch_read(&values[slot]);
+  }
+
+  template <class Q> size_t find_slot(const Q &k, size_t h) const {
+    int8_t tag = h2(h);
+    size_t g = h1(h) & (groups() - 1);
+    for (size_t i = 1;; i++) {
+      group grp(&ctrl[g * group::width]);
+      for (uint32_t m = grp.match(tag); m; m &= m - 1) {
+        size_t slot = g * group::width + std::countr_zero(m);
+        if (keys[slot] == k)
+          return slot;
+      }
+      if (grp.match_empty())
+        return npos;
+      g = (g + i) & (groups() - 1);
+    }
+  }
+
+  // to between a quarter and half full at the load factor
+  void shrink() {
+    size_t n = size_t(2 * _size / LF) + 1;
+    n = std::max(std::bit_ceil(n), group::width);
+    if (n < capacity) {
+      rehash(n);
+      release_cached<Alloc>();
+    }
+  }
+
+  // no duplicate check and no growth, for keys known to be absent
+  void insert_unique(K &&k, V &&v) {
+    size_t h = k.hash();
+    size_t g = h1(h) & (groups() - 1);
+    for (size_t i = 1;; i++) {
+      if (uint32_t m = group(&ctrl[g * group::width]).match_empty()) {
+        size_t slot = g * group::width + std::countr_zero(m);
+        ctrl[slot] = h2(h);
+        keys[slot] = std::move(k);
+        values[slot] = std::move(v);
+        _size++;
+        effective_size++;
+        return;
+      }
+      g = (g + i) & (groups() - 1);
+    }
+  }
+
+  size_t _size = 0;
+  size_t effective_size = 0;
+  size_t capacity;
+  alloc_vector<K, Alloc> keys;
+  alloc_vector<V, Alloc> values;
+  alloc_vector<int8_t, Alloc> ctrl;
+  double low_water = 0;
+};
+
+} // namespace crash
+
+#endif